@@ -44,6 +44,9 @@ typedef struct lf_fifo_s lf_fifo_t;
  * pushes discard the oldest element to make space.
  * Mixing non-overwriting and overwriting calls is undefined and not
  * supported. Use one API per FIFO instance.
+ * Bulk calls have *_elems() variants for elements of esize bytes, data
+ * then holds size elements and counts are in elements. LF_FIFO_DEFINE()
+ * wraps them into FIFO of given element type.
  */
 struct lf_fifo_s {
 	atomic_uint head __attribute__((aligned(LF_FIFO_CACHELINE)));
@@ -104,8 +107,8 @@ static inline unsigned int lf_fifo_push(lf_fifo_t *f, uint8_t byte)
 }
 
 
-/* Push up to n bytes. Returns how many actually pushed. */
-static inline unsigned int lf_fifo_push_many(lf_fifo_t *f, const uint8_t *src, unsigned int n)
+/* Push up to n elements of esize bytes. Returns how many actually pushed. */
+static inline unsigned int lf_fifo_push_elems(lf_fifo_t *f, const void *src, unsigned int n, size_t esize)
 {
 	if (n == 0u) {
 		return 0u;
@@ -129,9 +132,9 @@ static inline unsigned int lf_fifo_push_many(lf_fifo_t *f, const uint8_t *src, u
 		m = n;
 	}
 
-	memcpy(f->data + head, src, m);
+	memcpy(f->data + head * esize, src, m * esize);
 	if (n > m) {
-		memcpy(f->data, src + m, n - m);
+		memcpy(f->data, (const uint8_t *)src + m * esize, (n - m) * esize);
 	}
 
 	/* publish new head so consumer can see data */
@@ -141,6 +144,13 @@ static inline unsigned int lf_fifo_push_many(lf_fifo_t *f, const uint8_t *src, u
 }
 
 
+/* Push up to n bytes. Returns how many actually pushed. */
+static inline unsigned int lf_fifo_push_many(lf_fifo_t *f, const uint8_t *src, unsigned int n)
+{
+	return lf_fifo_push_elems(f, src, n, 1u);
+}
+
+
 /* Returns 1 if element has been popped, 0 otherwise. */
 static inline unsigned int lf_fifo_pop(lf_fifo_t *f, uint8_t *byte)
 {
@@ -161,8 +171,8 @@ static inline unsigned int lf_fifo_pop(lf_fifo_t *f, uint8_t *byte)
 }
 
 
-/* Pop up to n bytes. Returns how many actually popped. */
-static inline unsigned int lf_fifo_pop_many(lf_fifo_t *f, uint8_t *dst, unsigned int n)
+/* Pop up to n elements of esize bytes. Returns how many actually popped. */
+static inline unsigned int lf_fifo_pop_elems(lf_fifo_t *f, void *dst, unsigned int n, size_t esize)
 {
 	if (n == 0u) {
 		return 0u;
@@ -186,9 +196,9 @@ static inline unsigned int lf_fifo_pop_many(lf_fifo_t *f, uint8_t *dst, unsigned
 		m = n;
 	}
 
-	memcpy(dst, f->data + tail, m);
+	memcpy(dst, f->data + tail * esize, m * esize);
 	if (n > m) {
-		memcpy(dst + m, f->data, n - m);
+		memcpy((uint8_t *)dst + m * esize, f->data, (n - m) * esize);
 	}
 
 	/* publish new tail so producer can reuse slot */
@@ -198,6 +208,13 @@ static inline unsigned int lf_fifo_pop_many(lf_fifo_t *f, uint8_t *dst, unsigned
 }
 
 
+/* Pop up to n bytes. Returns how many actually popped. */
+static inline unsigned int lf_fifo_pop_many(lf_fifo_t *f, uint8_t *dst, unsigned int n)
+{
+	return lf_fifo_pop_elems(f, dst, n, 1u);
+}
+
+
 /* Returns 1 if FIFO is full, 0 otherwise. */
 static inline bool lf_fifo_full(const lf_fifo_t *f)
 {
@@ -242,15 +259,15 @@ static inline void lf_fifo_ow_push(lf_fifo_t *f, uint8_t byte)
 }
 
 
-/* Always succeeds. If full, overwrites oldest. */
-static inline void lf_fifo_ow_push_many(lf_fifo_t *f, const uint8_t *src, unsigned int n)
+/* Pushes n elements of esize bytes. Always succeeds. If full, overwrites oldest. */
+static inline void lf_fifo_ow_push_elems(lf_fifo_t *f, const void *src, unsigned int n, size_t esize)
 {
 	if (n == 0u) {
 		return;
 	}
 
 	if (n > f->size) {
-		src += n - f->size;
+		src = (const uint8_t *)src + (n - f->size) * esize;
 		n = f->size;
 	}
 
@@ -262,9 +279,9 @@ static inline void lf_fifo_ow_push_many(lf_fifo_t *f, const uint8_t *src, unsign
 		m = n;
 	}
 
-	memcpy(f->data + (head & f->mask), src, m);
+	memcpy(f->data + (head & f->mask) * esize, src, m * esize);
 	if (n > m) {
-		memcpy(f->data, src + m, n - m);
+		memcpy(f->data, (const uint8_t *)src + m * esize, (n - m) * esize);
 	}
 
 	/* publish new head so consumer can see data */
@@ -272,6 +289,13 @@ static inline void lf_fifo_ow_push_many(lf_fifo_t *f, const uint8_t *src, unsign
 }
 
 
+/* Always succeeds. If full, overwrites oldest. */
+static inline void lf_fifo_ow_push_many(lf_fifo_t *f, const uint8_t *src, unsigned int n)
+{
+	lf_fifo_ow_push_elems(f, src, n, 1u);
+}
+
+
 /* Returns 1 if element has been popped, 0 otherwise. */
 static inline unsigned int lf_fifo_ow_pop(lf_fifo_t *f, uint8_t *byte)
 {
@@ -292,14 +316,15 @@ static inline unsigned int lf_fifo_ow_pop(lf_fifo_t *f, uint8_t *byte)
 
 	*byte = f->data[tail & f->mask];
 
-	atomic_store_explicit(&f->tail, tail + 1u, memory_order_relaxed);
+	/* publish new tail so producer can reuse slot */
+	atomic_store_explicit(&f->tail, tail + 1u, memory_order_release);
 
 	return 1u;
 }
 
 
-/* Pop up to n bytes. Returns how many actually popped. */
-static inline unsigned int lf_fifo_ow_pop_many(lf_fifo_t *f, uint8_t *dst, unsigned int n)
+/* Pop up to n elements of esize bytes. Returns how many actually popped. */
+static inline unsigned int lf_fifo_ow_pop_elems(lf_fifo_t *f, void *dst, unsigned int n, size_t esize)
 {
 	if (n == 0u) {
 		return 0u;
@@ -331,9 +356,9 @@ static inline unsigned int lf_fifo_ow_pop_many(lf_fifo_t *f, uint8_t *dst, unsig
 		m = n;
 	}
 
-	memcpy(dst, f->data + (tail & f->mask), m);
+	memcpy(dst, f->data + (tail & f->mask) * esize, m * esize);
 	if (n > m) {
-		memcpy(dst + m, f->data, n - m);
+		memcpy((uint8_t *)dst + m * esize, f->data, (n - m) * esize);
 	}
 
 	/* publish new tail so producer can reuse slot */
@@ -343,6 +368,13 @@ static inline unsigned int lf_fifo_ow_pop_many(lf_fifo_t *f, uint8_t *dst, unsig
 }
 
 
+/* Pop up to n bytes. Returns how many actually popped. */
+static inline unsigned int lf_fifo_ow_pop_many(lf_fifo_t *f, uint8_t *dst, unsigned int n)
+{
+	return lf_fifo_ow_pop_elems(f, dst, n, 1u);
+}
+
+
 /* Returns number of used elements. */
 static inline unsigned int lf_fifo_ow_used(const lf_fifo_t *f)
 {
@@ -358,4 +390,88 @@ static inline unsigned int lf_fifo_ow_used(const lf_fifo_t *f)
 	return used;
 }
 
+
+/* --------------------- Typed FIFO --------------------- */
+
+/*
+ * Defines lf_fifo_<name>_t FIFO of type elements with the API above, e.g. for driver events:
+ *   LF_FIFO_DEFINE(event, event_t)
+ * gives lf_fifo_event_t with lf_fifo_event_push(), lf_fifo_event_pop_many() etc.
+ * Size and counts are in elements.
+ */
+#define LF_FIFO_DEFINE(name, type) \
+	typedef struct { \
+		lf_fifo_t f; \
+	} lf_fifo_##name##_t; \
+\
+	static inline void lf_fifo_##name##_init(lf_fifo_##name##_t *q, type *data, unsigned int size) \
+	{ \
+		lf_fifo_init(&q->f, (uint8_t *)data, size); \
+	} \
+\
+	static inline bool lf_fifo_##name##_empty(const lf_fifo_##name##_t *q) \
+	{ \
+		return lf_fifo_empty(&q->f); \
+	} \
+\
+	static inline unsigned int lf_fifo_##name##_push(lf_fifo_##name##_t *q, type elem) \
+	{ \
+		return lf_fifo_push_elems(&q->f, &elem, 1u, sizeof(type)); \
+	} \
+\
+	static inline unsigned int lf_fifo_##name##_push_many(lf_fifo_##name##_t *q, const type *src, unsigned int n) \
+	{ \
+		return lf_fifo_push_elems(&q->f, src, n, sizeof(type)); \
+	} \
+\
+	static inline unsigned int lf_fifo_##name##_pop(lf_fifo_##name##_t *q, type *elem) \
+	{ \
+		return lf_fifo_pop_elems(&q->f, elem, 1u, sizeof(type)); \
+	} \
+\
+	static inline unsigned int lf_fifo_##name##_pop_many(lf_fifo_##name##_t *q, type *dst, unsigned int n) \
+	{ \
+		return lf_fifo_pop_elems(&q->f, dst, n, sizeof(type)); \
+	} \
+\
+	static inline bool lf_fifo_##name##_full(const lf_fifo_##name##_t *q) \
+	{ \
+		return lf_fifo_full(&q->f); \
+	} \
+\
+	static inline unsigned int lf_fifo_##name##_used(const lf_fifo_##name##_t *q) \
+	{ \
+		return lf_fifo_used(&q->f); \
+	} \
+\
+	static inline unsigned int lf_fifo_##name##_free(const lf_fifo_##name##_t *q) \
+	{ \
+		return lf_fifo_free(&q->f); \
+	} \
+\
+	static inline void lf_fifo_##name##_ow_push(lf_fifo_##name##_t *q, type elem) \
+	{ \
+		lf_fifo_ow_push_elems(&q->f, &elem, 1u, sizeof(type)); \
+	} \
+\
+	static inline void lf_fifo_##name##_ow_push_many(lf_fifo_##name##_t *q, const type *src, unsigned int n) \
+	{ \
+		lf_fifo_ow_push_elems(&q->f, src, n, sizeof(type)); \
+	} \
+\
+	static inline unsigned int lf_fifo_##name##_ow_pop(lf_fifo_##name##_t *q, type *elem) \
+	{ \
+		return lf_fifo_ow_pop_elems(&q->f, elem, 1u, sizeof(type)); \
+	} \
+\
+	static inline unsigned int lf_fifo_##name##_ow_pop_many(lf_fifo_##name##_t *q, type *dst, unsigned int n) \
+	{ \
+		return lf_fifo_ow_pop_elems(&q->f, dst, n, sizeof(type)); \
+	} \
+\
+	static inline unsigned int lf_fifo_##name##_ow_used(const lf_fifo_##name##_t *q) \
+	{ \
+		return lf_fifo_ow_used(&q->f); \
+	}
+
 #endif
@@ -0,0 +1,263 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Lock-free SPSC FIFO host test
+ *
+ * Checks FIFO of struct elements defined with LF_FIFO_DEFINE(): bulk calls wrapping around buffer end,
+ * overwriting calls dropping the oldest elements, and transfer between producer and consumer threads.
+ * Byte FIFO is checked as well.
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include "lf-fifo.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define TEST_SPSC_SIZE  64
+#define TEST_SPSC_COUNT 500000
+
+
+typedef struct {
+	uint64_t seq;
+	uint32_t a;
+	uint32_t b; /* ~a, torn element has it wrong */
+} test_rec_t;
+
+
+LF_FIFO_DEFINE(rec, test_rec_t)
+
+
+static int test_failed;
+
+
+static void test_check(int cond, const char *what)
+{
+	if (cond == 0) {
+		fprintf(stderr, "lf-fifo-test: %s failed\n", what);
+		test_failed = 1;
+	}
+}
+
+
+static test_rec_t test_rec(uint64_t seq)
+{
+	test_rec_t rec;
+
+	rec.seq = seq;
+	rec.a = (uint32_t)seq * 3u;
+	rec.b = ~rec.a;
+
+	return rec;
+}
+
+
+static int test_recsEqual(const test_rec_t *recs, unsigned int n, uint64_t seq)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		if (recs[i].seq != seq + i || recs[i].a != (uint32_t)(seq + i) * 3u || recs[i].b != ~recs[i].a) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+/* Bulk calls are split at buffer end, starting there the other way round too */
+static void test_wrap(void)
+{
+	unsigned int i;
+	test_rec_t buf[8], in[16], out[16];
+	lf_fifo_rec_t f;
+
+	for (i = 0; i < 16; ++i) {
+		in[i] = test_rec(i);
+	}
+
+	lf_fifo_rec_init(&f, buf, 8);
+	test_check(lf_fifo_rec_empty(&f) && lf_fifo_rec_free(&f) == 7, "empty FIFO");
+
+	/* head and tail at 5 */
+	test_check(lf_fifo_rec_push_many(&f, in, 5) == 5, "push_many");
+	test_check(lf_fifo_rec_pop_many(&f, out, 5) == 5 && test_recsEqual(out, 5, 0), "pop_many");
+
+	/* 3 elements up to buffer end, 4 from its beginning */
+	test_check(lf_fifo_rec_push_many(&f, in + 5, 10) == 7, "push_many over buffer end");
+	test_check(lf_fifo_rec_full(&f) && lf_fifo_rec_used(&f) == 7, "full FIFO");
+	test_check(lf_fifo_rec_push(&f, in[12]) == 0, "push into full FIFO");
+	test_check(lf_fifo_rec_pop_many(&f, out, 16) == 7 && test_recsEqual(out, 7, 5), "pop_many over buffer end");
+	test_check(lf_fifo_rec_pop(&f, out) == 0 && lf_fifo_rec_empty(&f), "pop from empty FIFO");
+
+	/* Single calls step over buffer end, bulk pop starts right before it */
+	for (i = 0; i < 6; ++i) {
+		test_check(lf_fifo_rec_push(&f, in[i]) == 1, "push");
+	}
+	test_check(lf_fifo_rec_pop(&f, out) == 1 && test_recsEqual(out, 1, 0), "pop over buffer end");
+	test_check(lf_fifo_rec_pop_many(&f, out, 2) == 2 && test_recsEqual(out, 2, 1), "pop_many up to buffer end");
+	test_check(lf_fifo_rec_pop_many(&f, out, 16) == 3 && test_recsEqual(out, 3, 3), "pop_many from buffer start");
+}
+
+
+/* Elements pushed over capacity replace the oldest ones, pops skip those already replaced */
+static void test_overwrite(void)
+{
+	unsigned int i;
+	test_rec_t buf[8], in[24], out[24];
+	lf_fifo_rec_t f;
+
+	for (i = 0; i < 24; ++i) {
+		in[i] = test_rec(i);
+	}
+
+	lf_fifo_rec_init(&f, buf, 8);
+
+	lf_fifo_rec_ow_push_many(&f, in, 5);
+	test_check(lf_fifo_rec_ow_used(&f) == 5, "ow_push_many");
+
+	/* 11 pushed, 3..10 kept, buffer wraps */
+	lf_fifo_rec_ow_push_many(&f, in + 5, 6);
+	test_check(lf_fifo_rec_ow_used(&f) == 8, "ow_push_many over capacity");
+	test_check(lf_fifo_rec_ow_pop_many(&f, out, 2) == 2 && test_recsEqual(out, 2, 3), "ow_pop_many after overwrite");
+
+	/* 5..10 left, 13 more pushed in one call keep 16..23 only */
+	lf_fifo_rec_ow_push_many(&f, in + 11, 13);
+	test_check(lf_fifo_rec_ow_used(&f) == 8, "ow_push_many above capacity");
+	test_check(lf_fifo_rec_ow_pop_many(&f, out, 24) == 8 && test_recsEqual(out, 8, 16), "ow_pop_many of whole buffer");
+	test_check(lf_fifo_rec_ow_pop(&f, out) == 0 && lf_fifo_rec_ow_used(&f) == 0, "ow_pop from empty FIFO");
+
+	/* Single calls overwrite as well */
+	for (i = 0; i < 10; ++i) {
+		lf_fifo_rec_ow_push(&f, in[i]);
+	}
+	test_check(lf_fifo_rec_ow_pop(&f, out) == 1 && test_recsEqual(out, 1, 2), "ow_pop after overwrite");
+	test_check(lf_fifo_rec_ow_pop_many(&f, out, 24) == 7 && test_recsEqual(out, 7, 3), "ow_pop_many over buffer end");
+}
+
+
+static lf_fifo_rec_t test_spscFifo;
+static atomic_int test_spscOk; /* Cleared by consumer on bad element, so producer does not wait for it */
+
+
+static void *test_producer(void *arg)
+{
+	unsigned int i, k, n;
+	uint64_t seq = 0;
+	test_rec_t recs[7];
+
+	while (seq < TEST_SPSC_COUNT && atomic_load(&test_spscOk) != 0) {
+		k = (seq % 3 == 0) ? 1 : 1 + seq % 7;
+		if (seq + k > TEST_SPSC_COUNT) {
+			k = TEST_SPSC_COUNT - seq;
+		}
+
+		for (i = 0; i < k; ++i) {
+			recs[i] = test_rec(seq + i);
+		}
+
+		n = (k == 1) ? lf_fifo_rec_push(&test_spscFifo, recs[0]) : lf_fifo_rec_push_many(&test_spscFifo, recs, k);
+		if (n == 0) {
+			sched_yield();
+		}
+		seq += n;
+	}
+
+	return NULL;
+}
+
+
+static void *test_consumer(void *arg)
+{
+	unsigned int n;
+	uint64_t seq = 0;
+	test_rec_t recs[9];
+
+	while (seq < TEST_SPSC_COUNT && atomic_load(&test_spscOk) != 0) {
+		n = ((seq & 1) != 0) ? lf_fifo_rec_pop(&test_spscFifo, recs) : lf_fifo_rec_pop_many(&test_spscFifo, recs, 1 + seq % 9);
+		if (n == 0) {
+			sched_yield();
+		}
+		else if (test_recsEqual(recs, n, seq) == 0) {
+			atomic_store(&test_spscOk, 0);
+		}
+		seq += n;
+	}
+
+	return NULL;
+}
+
+
+/* Producer and consumer threads mix single and bulk calls of varying counts, so they wrap at every offset */
+static void test_spsc(void)
+{
+	static test_rec_t buf[TEST_SPSC_SIZE];
+	pthread_t prod, cons;
+
+	lf_fifo_rec_init(&test_spscFifo, buf, TEST_SPSC_SIZE);
+	atomic_store(&test_spscOk, 1);
+
+	if (pthread_create(&cons, NULL, test_consumer, NULL) != 0) {
+		test_check(0, "consumer thread creation");
+		return;
+	}
+
+	if (pthread_create(&prod, NULL, test_producer, NULL) != 0) {
+		test_check(0, "producer thread creation");
+		atomic_store(&test_spscOk, 0);
+	}
+	else {
+		pthread_join(prod, NULL);
+	}
+	pthread_join(cons, NULL);
+
+	test_check(atomic_load(&test_spscOk) != 0 && lf_fifo_rec_empty(&test_spscFifo), "SPSC transfer");
+}
+
+
+static void test_bytes(void)
+{
+	uint8_t buf[16], out[16];
+	lf_fifo_t f;
+
+	lf_fifo_init(&f, buf, 16);
+
+	test_check(lf_fifo_push(&f, 7) == 1, "byte push");
+	test_check(lf_fifo_push_many(&f, (const uint8_t *)"abcdefghijklmnop", 16) == 14, "byte push_many");
+	test_check(lf_fifo_full(&f) && lf_fifo_free(&f) == 0, "full byte FIFO");
+	test_check(lf_fifo_pop(&f, out) == 1 && out[0] == 7, "byte pop");
+	test_check(lf_fifo_pop_many(&f, out, 16) == 14 && memcmp(out, "abcdefghijklmn", 14) == 0, "byte pop_many");
+
+	lf_fifo_init(&f, buf, 16);
+	lf_fifo_ow_push_many(&f, (const uint8_t *)"0123456789abcdefghij", 20);
+	test_check(lf_fifo_ow_pop(&f, out) == 1 && out[0] == '4', "byte ow_pop");
+	test_check(lf_fifo_ow_pop_many(&f, out, 16) == 15 && memcmp(out, "56789abcdefghij", 15) == 0, "byte ow_pop_many");
+}
+
+
+int main(void)
+{
+	test_wrap();
+	test_overwrite();
+	test_spsc();
+	test_bytes();
+
+	if (test_failed != 0) {
+		return EXIT_FAILURE;
+	}
+
+	printf("lf-fifo-test: passed\n");
+
+	return EXIT_SUCCESS;
+}
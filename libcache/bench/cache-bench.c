@@ -0,0 +1,1716 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Cache library benchmark
+ *
+ * Runs libcache on host against in-memory device with configurable per-operation latency.
+ * Replays address trace or synthetic sequential, random, zipfian or hot spot workload for every
+ * combination of line size, line count and replacement policy given. Synthetic workload may be
+ * interleaved with full device scans, which are left out of reported hit ratio. Mixed workload of
+ * unaligned and vectored accesses of random length, run with -V and injected asynchronous faults,
+ * checks data consistency ("make check"). Cache may be resized back and forth while workload runs.
+ * Tear workload checks that reads, lock-free hits in particular, never return partially updated block
+ * or block of other address.
+ *
+ * Trace file holds one access per line: "<r|w|f> <addr> <len>", f flushes the range.
+ * Blank lines and lines starting with '#' are skipped.
+ *
+ * Reference runs:
+ *   lookup cost of hits, 4 B reads of 256 x 64 B resident lines (ns/op = 1e9 / ops/s)
+ *     cache-bench -l 64 -n 256 -d 16k -s 4 -w 0 -u 100000 -o 2000000
+ *   lock scaling, 70/20/10 read/write/flush mix on disjoint ranges, one and 16 set locks
+ *     cache-bench -l 64 -n 512 -d 1m -s 64 -w 20 -f 10 -R 20 -W 20 -D -t 1,2,4,8 -L 1
+ *     cache-bench -l 64 -n 512 -d 1m -s 64 -w 20 -f 10 -R 20 -W 20 -D -t 1,2,4,8 -L 16
+ *   replacement policies, 1024 x 512 B lines over 16384 line device, 400k single line reads
+ *     cache-bench -p lru,clock,2q -a 8 -d 8m -w 0 -o 400000 -m hot -x 75 -X 256k -C 20000
+ *     cache-bench -p lru,clock,2q -a 8 -d 8m -w 0 -o 400000 -m zipf -z 0.9 -C 20000
+ *     cache-bench -p lru,clock,2q -a 8 -d 8m -w 0 -o 400000 -m zipf -z 0.9
+ *     cache-bench -p lru,clock,2q -a 8 -d 8m -w 0 -o 400000 -m seq -r 640k
+ *   with -a full for fully associative cache
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include "../cache.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+
+
+#define BENCH_LIST_MAX   16
+#define BENCH_SEGS       16   /* Max number of segments of vectored access in mixed workload */
+#define BENCH_RESIZE_US  1000 /* Interval of resizes while workload runs */
+#define BENCH_TEAR_BLOCK 256  /* Block of tear workload, its address followed by single byte value */
+
+
+enum { bench_seq, bench_rand, bench_zipf, bench_hot, bench_mix, bench_tear, bench_trace };
+
+
+typedef struct {
+	char op;
+	uint64_t addr;
+	size_t len;
+} bench_op_t;
+
+
+/* Asynchronous request queued to device threads */
+typedef struct bench_req_s {
+	struct bench_req_s *next;
+	uint64_t offset;
+	const cache_iov_t *iov;
+	size_t iovcnt;
+	cache_iov_t part; /* Shortened single segment of partial transfer */
+	int write;
+	cache_doneCb_t done;
+	void *arg;
+} bench_req_t;
+
+
+struct cache_devCtx_s {
+	unsigned char *mem;
+	uint64_t size;
+	long rdLat; /* Per callback latency (us) */
+	long wrLat;
+	pthread_mutex_t lock;
+
+	/* Asynchronous callbacks */
+	size_t nthreads;
+	pthread_t *threads;
+	bench_req_t *head;
+	bench_req_t *tail;
+	pthread_cond_t cond;
+	int stop;
+
+	/* Injected faults of asynchronous requests */
+	unsigned int faultPct;
+	uint64_t faultRng;
+};
+
+
+static struct {
+	cache_devCtx_t dev;
+	unsigned char *shadow; /* Expected device content in verify mode */
+
+	size_t lineSizes[BENCH_LIST_MAX];
+	size_t nLineSizes;
+	size_t linesCnts[BENCH_LIST_MAX];
+	size_t nLinesCnts;
+	unsigned int policies[BENCH_LIST_MAX];
+	size_t nPolicies;
+	size_t threadCnts[BENCH_LIST_MAX];
+	size_t nThreadCnts;
+	size_t resizeCnts[BENCH_LIST_MAX]; /* Line counts cycled through while measured workload runs */
+	size_t nResizeCnts;
+	atomic_int resizeStop;
+	atomic_int tearDone; /* Thread 0 finished its share of tear workload */
+	cache_opts_t opts;
+	int writePolicy;
+	int noVec; /* Multi-line transfers go through bounce buffers of cache */
+
+	int mode;
+	bench_op_t *trace;
+	size_t traceLen;
+	size_t ops;
+	size_t warmup;
+	size_t reqSize;
+	unsigned int writePct;
+	unsigned int flushPct;
+	double theta;
+	unsigned int hotPct;
+	size_t hotSize;
+	size_t range;
+	size_t scanOps;
+	uint64_t scanHits; /* Hits and misses of scans, left out of hit ratio */
+	uint64_t scanMisses;
+	double *zipfCdf;
+	uint64_t zipfPerm;
+	size_t nthreads;
+	uint64_t seed;
+	int verify;
+	int disjoint;
+	int restart;
+	size_t restartLine; /* Line size of restarted cache, 0 - the same */
+
+	cachectx_t *cache;
+	atomic_int errors;
+} bench;
+
+
+typedef struct {
+	size_t id;
+	uint64_t rng;
+	uint64_t seqAddr;
+	size_t tracePos;
+	unsigned char *buf;
+	unsigned char *chk;
+	cache_seg_t segs[BENCH_SEGS]; /* Vectored access, op.len holds number of segments */
+	int segPolicy; /* Write policy of vectored access or tear workload write */
+} bench_thread_t;
+
+
+static const char *bench_policyNames[] = { "lru", "clock", "2q" };
+
+
+static const char *bench_modeNames[] = { "seq", "rand", "zipf", "hot", "mix", "tear", "trace" };
+
+
+static void bench_delay(long us)
+{
+	struct timespec ts;
+
+	if (us <= 0) {
+		return;
+	}
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+	}
+}
+
+
+static ssize_t bench_devTransfer(cache_devCtx_t *dev, uint64_t offset, const cache_iov_t *iov, size_t iovcnt, int write)
+{
+	size_t i, len;
+	ssize_t count = 0;
+
+	bench_delay(write ? dev->wrLat : dev->rdLat);
+
+	if (offset >= dev->size) {
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	for (i = 0; i < iovcnt && offset + count < dev->size; ++i) {
+		len = iov[i].len;
+		if (offset + count + len > dev->size) {
+			len = dev->size - offset - count;
+		}
+
+		if (write != 0) {
+			memcpy(dev->mem + offset + count, iov[i].buf, len);
+		}
+		else {
+			memcpy(iov[i].buf, dev->mem + offset + count, len);
+		}
+		count += len;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return count;
+}
+
+
+static ssize_t bench_read(uint64_t offset, void *buffer, size_t count, cache_devCtx_t *ctx)
+{
+	cache_iov_t iov = { .buf = buffer, .len = count };
+
+	return bench_devTransfer(ctx, offset, &iov, 1, 0);
+}
+
+
+static ssize_t bench_write(uint64_t offset, const void *buffer, size_t count, cache_devCtx_t *ctx)
+{
+	cache_iov_t iov = { .buf = (void *)buffer, .len = count };
+
+	return bench_devTransfer(ctx, offset, &iov, 1, 1);
+}
+
+
+static ssize_t bench_readv(uint64_t offset, const cache_iov_t *iov, size_t iovcnt, cache_devCtx_t *ctx)
+{
+	return bench_devTransfer(ctx, offset, iov, iovcnt, 0);
+}
+
+
+static ssize_t bench_writev(uint64_t offset, const cache_iov_t *iov, size_t iovcnt, cache_devCtx_t *ctx)
+{
+	return bench_devTransfer(ctx, offset, iov, iovcnt, 1);
+}
+
+
+static uint64_t bench_rand64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+
+/* Injected fault either rejects request or makes it transfer only part of its data */
+static int bench_queue(cache_devCtx_t *dev, uint64_t offset, const cache_iov_t *iov, size_t iovcnt, int write, cache_doneCb_t done, void *arg)
+{
+	unsigned int fault = 0;
+	bench_req_t *req = malloc(sizeof(bench_req_t));
+
+	if (req == NULL) {
+		return -ENOMEM;
+	}
+
+	req->next = NULL;
+	req->offset = offset;
+	req->iov = iov;
+	req->iovcnt = iovcnt;
+	req->write = write;
+	req->done = done;
+	req->arg = arg;
+
+	pthread_mutex_lock(&dev->lock);
+	if (dev->faultPct != 0 && (bench_rand64(&dev->faultRng) % 100) < dev->faultPct) {
+		fault = 1 + (unsigned int)(bench_rand64(&dev->faultRng) & 1);
+	}
+
+	if (fault == 1) {
+		pthread_mutex_unlock(&dev->lock);
+		free(req);
+		return -EAGAIN;
+	}
+
+	if (fault == 2) {
+		if (iovcnt > 1) {
+			req->iovcnt--;
+		}
+		else {
+			req->part.buf = iov[0].buf;
+			req->part.len = iov[0].len / 2;
+			req->iov = &req->part;
+		}
+	}
+
+	if (dev->tail != NULL) {
+		dev->tail->next = req;
+	}
+	else {
+		dev->head = req;
+	}
+	dev->tail = req;
+	pthread_cond_signal(&dev->cond);
+	pthread_mutex_unlock(&dev->lock);
+
+	return 0;
+}
+
+
+static int bench_readAsync(uint64_t offset, const cache_iov_t *iov, size_t iovcnt, cache_doneCb_t done, void *arg, cache_devCtx_t *ctx)
+{
+	return bench_queue(ctx, offset, iov, iovcnt, 0, done, arg);
+}
+
+
+static int bench_writeAsync(uint64_t offset, const cache_iov_t *iov, size_t iovcnt, cache_doneCb_t done, void *arg, cache_devCtx_t *ctx)
+{
+	return bench_queue(ctx, offset, iov, iovcnt, 1, done, arg);
+}
+
+
+/* Device channel, serves one queued request at a time */
+static void *bench_devThread(void *arg)
+{
+	cache_devCtx_t *dev = arg;
+	bench_req_t *req;
+
+	pthread_mutex_lock(&dev->lock);
+	for (;;) {
+		while (dev->head == NULL && dev->stop == 0) {
+			pthread_cond_wait(&dev->cond, &dev->lock);
+		}
+
+		if (dev->head == NULL) {
+			break;
+		}
+
+		req = dev->head;
+		dev->head = req->next;
+		if (dev->head == NULL) {
+			dev->tail = NULL;
+		}
+		pthread_mutex_unlock(&dev->lock);
+
+		req->done(req->arg, bench_devTransfer(dev, req->offset, req->iov, req->iovcnt, req->write));
+		free(req);
+
+		pthread_mutex_lock(&dev->lock);
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return NULL;
+}
+
+
+static uint64_t bench_gcd(uint64_t a, uint64_t b)
+{
+	uint64_t t;
+
+	while (b != 0) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+
+/* Cumulative distribution of ranks, hot ranks are scattered over the range by multiplicative permutation */
+static int bench_zipfInit(uint64_t blocks)
+{
+	uint64_t i;
+	double sum = 0;
+
+	bench.zipfCdf = malloc(blocks * sizeof(double));
+	if (bench.zipfCdf == NULL) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < blocks; ++i) {
+		sum += 1.0 / pow((double)(i + 1), bench.theta);
+		bench.zipfCdf[i] = sum;
+	}
+
+	for (i = 0; i < blocks; ++i) {
+		bench.zipfCdf[i] /= sum;
+	}
+
+	bench.zipfPerm = 0x9e3779b97f4a7c15ULL % blocks;
+	while (bench.zipfPerm == 0 || bench_gcd(bench.zipfPerm, blocks) != 1) {
+		bench.zipfPerm++;
+	}
+
+	return 0;
+}
+
+
+static uint64_t bench_zipfBlock(uint64_t *rng, uint64_t blocks)
+{
+	double u = (double)(bench_rand64(rng) >> 11) / (double)(1ULL << 53);
+	uint64_t lo = 0, hi = blocks - 1, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (bench.zipfCdf[mid] < u) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return (unsigned __int128)lo * bench.zipfPerm % blocks;
+}
+
+
+/* Verify mode gives every thread its own slice of device, so expected content stays exact */
+static void bench_slice(const bench_thread_t *thr, uint64_t *base, uint64_t *size)
+{
+	*base = 0;
+	*size = bench.dev.size;
+
+	if (bench.verify != 0 || bench.disjoint != 0) {
+		*size = bench.dev.size / bench.nthreads;
+		*size -= *size % bench.reqSize;
+		*base = thr->id * *size;
+	}
+
+	/* Synthetic workload covers only beginning of slice */
+	if (bench.range != 0 && *size > bench.range) {
+		*size = bench.range - bench.range % bench.reqSize;
+	}
+}
+
+
+/*
+ * Segments of vectored access share request buffer, they are either close to op->addr or anywhere in slice,
+ * so they may be adjacent, overlap or be empty. op->len becomes number of segments.
+ */
+static void bench_segments(bench_thread_t *thr, bench_op_t *op, uint64_t base, uint64_t size)
+{
+	size_t i, n, len, used = 0;
+	uint64_t near;
+
+	n = 1 + bench_rand64(&thr->rng) % BENCH_SEGS;
+	for (i = 0; i < n; ++i) {
+		len = bench_rand64(&thr->rng) % (bench.reqSize / n + 1);
+		if (used + len > bench.reqSize) {
+			len = 0;
+		}
+
+		if ((bench_rand64(&thr->rng) % 3) != 0) {
+			near = op->addr - base + bench_rand64(&thr->rng) % (2 * bench.reqSize);
+			thr->segs[i].addr = base + ((near + len <= size) ? near : size - len);
+		}
+		else {
+			thr->segs[i].addr = base + bench_rand64(&thr->rng) % (size - len + 1);
+		}
+		thr->segs[i].len = len;
+		thr->segs[i].buf = ((op->op == 'v') ? thr->chk : thr->buf) + used;
+		used += len;
+	}
+
+	op->len = n;
+	thr->segPolicy = ((bench_rand64(&thr->rng) & 1) != 0) ? LIBCACHE_WRITE_THROUGH : LIBCACHE_WRITE_BACK;
+}
+
+
+static void bench_tearFill(unsigned char *buf, uint64_t addr, unsigned char val)
+{
+	memcpy(buf, &addr, sizeof(addr));
+	memset(buf + sizeof(addr), val, BENCH_TEAR_BLOCK - sizeof(addr));
+}
+
+
+/* Returns offset of the first inconsistent byte of block read at addr, BENCH_TEAR_BLOCK if there is none */
+static size_t bench_tearCheck(const unsigned char *buf, uint64_t addr)
+{
+	size_t i;
+
+	if (memcmp(buf, &addr, sizeof(addr)) != 0) {
+		return 0;
+	}
+
+	for (i = sizeof(addr) + 1; i < BENCH_TEAR_BLOCK; ++i) {
+		if (buf[i] != buf[sizeof(addr)]) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+
+static void bench_next(bench_thread_t *thr, bench_op_t *op)
+{
+	unsigned int pct;
+	uint64_t base, size, blocks, hotBlocks;
+	size_t len;
+
+	if (bench.mode == bench_trace) {
+		*op = bench.trace[thr->tracePos];
+		thr->tracePos += bench.nthreads;
+		if (thr->tracePos >= bench.traceLen) {
+			thr->tracePos = thr->id % bench.traceLen;
+		}
+		return;
+	}
+
+	/*
+	 * Thread 0 rewrites, invalidates and evicts blocks of the first 1/16 of device, reading the rest of it,
+	 * other threads read the blocks. Each block always holds its address and single byte value, on device as well.
+	 */
+	if (bench.mode == bench_tear) {
+		size = (bench.dev.size / 16) - (bench.dev.size / 16) % BENCH_TEAR_BLOCK;
+		op->len = BENCH_TEAR_BLOCK;
+		op->addr = (bench_rand64(&thr->rng) % (size / BENCH_TEAR_BLOCK)) * BENCH_TEAR_BLOCK;
+		op->op = 'k';
+		if (thr->id == 0) {
+			pct = bench_rand64(&thr->rng) % 100;
+			op->op = (pct < 60) ? 'u' : (pct < 70) ? 'i' : 'e';
+			if (op->op == 'e') {
+				op->addr = size + bench_rand64(&thr->rng) % (bench.dev.size - size - BENCH_TEAR_BLOCK + 1);
+			}
+			thr->segPolicy = ((bench_rand64(&thr->rng) & 1) != 0) ? LIBCACHE_WRITE_THROUGH : LIBCACHE_WRITE_BACK;
+		}
+		return;
+	}
+
+	bench_slice(thr, &base, &size);
+	blocks = size / bench.reqSize;
+
+	/* Unaligned accesses of random length up to request size, written back or through */
+	if (bench.mode == bench_mix) {
+		pct = bench_rand64(&thr->rng) % 100;
+		op->op = (pct < 30) ? 'r' : (pct < 40) ? 'v' : (pct < 65) ? 'w' : (pct < 75) ? 'x' : (pct < 85) ? 't' : (pct < 93) ? 'f' : 'c';
+		len = 1 + bench_rand64(&thr->rng) % bench.reqSize;
+		op->len = len;
+		op->addr = base + bench_rand64(&thr->rng) % (size - len + 1);
+		if (op->op == 'v' || op->op == 'x') {
+			bench_segments(thr, op, base, size);
+		}
+		return;
+	}
+
+	pct = bench_rand64(&thr->rng) % 100;
+	if (pct < bench.writePct) {
+		op->op = 'w';
+	}
+	else if (pct < bench.writePct + bench.flushPct) {
+		op->op = 'f';
+	}
+	else {
+		op->op = 'r';
+	}
+	op->len = bench.reqSize;
+
+	switch (bench.mode) {
+		case bench_seq:
+			if (thr->seqAddr + bench.reqSize > size) {
+				thr->seqAddr = 0;
+			}
+			op->addr = base + thr->seqAddr;
+			thr->seqAddr += bench.reqSize;
+			break;
+
+		case bench_zipf:
+			op->addr = base + bench_zipfBlock(&thr->rng, blocks) * bench.reqSize;
+			break;
+
+		/* Requests of hot share go to hot region at beginning of slice, the rest anywhere in it */
+		case bench_hot:
+			hotBlocks = ((bench.hotSize != 0) ? bench.hotSize : size / 16) / bench.reqSize;
+			if (hotBlocks == 0 || hotBlocks > blocks) {
+				hotBlocks = blocks;
+			}
+			if ((bench_rand64(&thr->rng) % 100) < bench.hotPct) {
+				blocks = hotBlocks;
+			}
+			op->addr = base + (bench_rand64(&thr->rng) % blocks) * bench.reqSize;
+			break;
+
+		default:
+			op->addr = base + (bench_rand64(&thr->rng) % blocks) * bench.reqSize;
+			break;
+	}
+}
+
+
+/* Reads whole device once, as fsck or checksum pass would, hits and misses are recorded apart */
+static void bench_scan(bench_thread_t *thr)
+{
+	uint64_t addr;
+	size_t len;
+	ssize_t ret;
+	cache_stats_t before, after;
+
+	cache_getStats(bench.cache, &before);
+
+	for (addr = 0; addr < bench.dev.size && atomic_load(&bench.errors) == 0; addr += len) {
+		len = (bench.dev.size - addr < bench.reqSize) ? bench.dev.size - addr : bench.reqSize;
+		ret = cache_read(bench.cache, addr, thr->chk, len);
+		if (ret != (ssize_t)len) {
+			fprintf(stderr, "cache-bench: scan read of %zu bytes at 0x%llx returned %zd\n", len, (unsigned long long)addr, ret);
+			atomic_fetch_add(&bench.errors, 1);
+		}
+		else if (bench.verify != 0 && memcmp(thr->chk, bench.shadow + addr, len) != 0) {
+			fprintf(stderr, "cache-bench: data mismatch scanning %zu bytes at 0x%llx\n", len, (unsigned long long)addr);
+			atomic_fetch_add(&bench.errors, 1);
+		}
+	}
+
+	cache_getStats(bench.cache, &after);
+	bench.scanHits += after.hits - before.hits;
+	bench.scanMisses += after.misses - before.misses;
+}
+
+
+static void bench_run(bench_thread_t *thr, size_t ops)
+{
+	size_t i, j, len;
+	ssize_t ret;
+	bench_op_t op;
+
+	/* Blocks are read as long as they are being updated */
+	for (i = 0; (i < ops || (bench.mode == bench_tear && thr->id != 0 && atomic_load(&bench.tearDone) == 0)) && atomic_load(&bench.errors) == 0; ++i) {
+		if (bench.scanOps != 0 && i % bench.scanOps == bench.scanOps - 1) {
+			bench_scan(thr);
+		}
+
+		bench_next(thr, &op);
+
+		switch (op.op) {
+			case 'r':
+				ret = cache_read(bench.cache, op.addr, thr->chk, op.len);
+				if (ret != (ssize_t)op.len) {
+					fprintf(stderr, "cache-bench: read of %zu bytes at 0x%llx returned %zd\n", op.len, (unsigned long long)op.addr, ret);
+					atomic_fetch_add(&bench.errors, 1);
+				}
+				else if (bench.verify != 0 && memcmp(thr->chk, bench.shadow + op.addr, op.len) != 0) {
+					fprintf(stderr, "cache-bench: data mismatch reading %zu bytes at 0x%llx\n", op.len, (unsigned long long)op.addr);
+					atomic_fetch_add(&bench.errors, 1);
+				}
+				break;
+
+			case 'w':
+			case 't':
+				if (bench.verify != 0) {
+					for (j = 0; j < op.len; ++j) {
+						thr->buf[j] = (unsigned char)bench_rand64(&thr->rng);
+					}
+				}
+
+				ret = cache_write(bench.cache, op.addr, thr->buf, op.len, (op.op == 't') ? LIBCACHE_WRITE_THROUGH : bench.writePolicy);
+				if (ret != (ssize_t)op.len) {
+					fprintf(stderr, "cache-bench: write of %zu bytes at 0x%llx returned %zd\n", op.len, (unsigned long long)op.addr, ret);
+					atomic_fetch_add(&bench.errors, 1);
+				}
+				else if (bench.verify != 0) {
+					memcpy(bench.shadow + op.addr, thr->buf, op.len);
+				}
+				break;
+
+			case 'v':
+				ret = cache_readv(bench.cache, thr->segs, op.len);
+				for (j = 0, len = 0; j < op.len; ++j) {
+					len += thr->segs[j].len;
+				}
+				if (ret != (ssize_t)len) {
+					fprintf(stderr, "cache-bench: readv of %zu segments returned %zd, expected %zu\n", op.len, ret, len);
+					atomic_fetch_add(&bench.errors, 1);
+					break;
+				}
+				for (j = 0; bench.verify != 0 && j < op.len; ++j) {
+					if (memcmp(thr->segs[j].buf, bench.shadow + thr->segs[j].addr, thr->segs[j].len) != 0) {
+						fprintf(stderr, "cache-bench: data mismatch reading segment of %zu bytes at 0x%llx\n", thr->segs[j].len, (unsigned long long)thr->segs[j].addr);
+						atomic_fetch_add(&bench.errors, 1);
+						break;
+					}
+				}
+				break;
+
+			case 'x':
+				for (j = 0, len = 0; j < op.len; ++j) {
+					len += thr->segs[j].len;
+				}
+				for (j = 0; bench.verify != 0 && j < len; ++j) {
+					thr->buf[j] = (unsigned char)bench_rand64(&thr->rng);
+				}
+
+				ret = cache_writev(bench.cache, thr->segs, op.len, thr->segPolicy);
+				if (ret != (ssize_t)len) {
+					fprintf(stderr, "cache-bench: writev of %zu segments returned %zd, expected %zu\n", op.len, ret, len);
+					atomic_fetch_add(&bench.errors, 1);
+					break;
+				}
+
+				/* Overlapping segments are written in order */
+				for (j = 0; bench.verify != 0 && j < op.len; ++j) {
+					memcpy(bench.shadow + thr->segs[j].addr, thr->segs[j].buf, thr->segs[j].len);
+				}
+				break;
+
+			case 'u':
+				bench_tearFill(thr->buf, op.addr, (unsigned char)bench_rand64(&thr->rng));
+				ret = cache_write(bench.cache, op.addr, thr->buf, op.len, thr->segPolicy);
+				if (ret != (ssize_t)op.len) {
+					fprintf(stderr, "cache-bench: write of %zu bytes at 0x%llx returned %zd\n", op.len, (unsigned long long)op.addr, ret);
+					atomic_fetch_add(&bench.errors, 1);
+				}
+				break;
+
+			case 'k':
+			case 'e':
+				ret = cache_read(bench.cache, op.addr, thr->chk, op.len);
+				if (ret != (ssize_t)op.len) {
+					fprintf(stderr, "cache-bench: read of %zu bytes at 0x%llx returned %zd\n", op.len, (unsigned long long)op.addr, ret);
+					atomic_fetch_add(&bench.errors, 1);
+					break;
+				}
+				j = (op.op == 'k') ? bench_tearCheck(thr->chk, op.addr) : op.len;
+				if (j != op.len) {
+					fprintf(stderr, "cache-bench: torn block read at 0x%llx, byte %zu differs\n", (unsigned long long)op.addr, j);
+					atomic_fetch_add(&bench.errors, 1);
+				}
+				break;
+
+			case 'i':
+				ret = cache_invalidate(bench.cache, op.addr, op.addr + op.len);
+				if (ret < 0) {
+					fprintf(stderr, "cache-bench: invalidate of %zu bytes at 0x%llx failed (%zd)\n", op.len, (unsigned long long)op.addr, ret);
+					atomic_fetch_add(&bench.errors, 1);
+				}
+				break;
+
+			default:
+				ret = (op.op == 'c') ? cache_clean(bench.cache, op.addr, op.addr + op.len) : cache_flush(bench.cache, op.addr, op.addr + op.len);
+				if (ret < 0) {
+					fprintf(stderr, "cache-bench: %s of %zu bytes at 0x%llx failed (%zd)\n", (op.op == 'c') ? "clean" : "flush", op.len, (unsigned long long)op.addr, ret);
+					atomic_fetch_add(&bench.errors, 1);
+				}
+				break;
+		}
+	}
+
+	if (thr->id == 0) {
+		atomic_store(&bench.tearDone, 1);
+	}
+}
+
+
+static void *bench_warmupThread(void *arg)
+{
+	bench_thread_t *thr = arg;
+
+	bench_run(thr, (bench.warmup + thr->id) / bench.nthreads);
+
+	return NULL;
+}
+
+
+static void *bench_thread(void *arg)
+{
+	bench_thread_t *thr = arg;
+
+	bench_run(thr, (bench.ops + thr->id) / bench.nthreads);
+
+	return NULL;
+}
+
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+/* Line counts which do not fit pinned lines or keep getting dirty are skipped */
+static void *bench_resizeThread(void *arg)
+{
+	int err;
+	size_t i;
+
+	for (i = 0; atomic_load(&bench.resizeStop) == 0 && atomic_load(&bench.errors) == 0; ++i) {
+		err = cache_resize(bench.cache, bench.resizeCnts[i % bench.nResizeCnts]);
+		if (err < 0 && err != -EBUSY && err != -EAGAIN) {
+			fprintf(stderr, "cache-bench: resize to %zu lines failed (%d)\n", bench.resizeCnts[i % bench.nResizeCnts], err);
+			atomic_fetch_add(&bench.errors, 1);
+		}
+		bench_delay(BENCH_RESIZE_US);
+	}
+
+	return NULL;
+}
+
+
+static int bench_spawn(bench_thread_t *thrs, pthread_t *tids, void *(*start)(void *))
+{
+	size_t i;
+
+	atomic_store(&bench.tearDone, 0);
+
+	for (i = 0; i < bench.nthreads; ++i) {
+		if (pthread_create(&tids[i], NULL, start, &thrs[i]) != 0) {
+			fprintf(stderr, "cache-bench: failed to create thread\n");
+			atomic_fetch_add(&bench.errors, 1);
+			break;
+		}
+	}
+
+	while (i-- > 0) {
+		pthread_join(tids[i], NULL);
+	}
+
+	return (atomic_load(&bench.errors) != 0) ? -1 : 0;
+}
+
+
+static uint64_t bench_hotAddr(const unsigned char *blob, size_t hdrSize, size_t i)
+{
+	uint64_t addr;
+
+	memcpy(&addr, blob + hdrSize + i * sizeof(uint64_t), sizeof(uint64_t));
+
+	return addr;
+}
+
+
+/* Blob exported into half of needed space has to hold the hottest half of full export */
+static int bench_checkPartial(const unsigned char *blob, ssize_t size, size_t hdrSize)
+{
+	size_t i, half = (size - hdrSize) / sizeof(uint64_t) / 2;
+	ssize_t ret;
+	unsigned char *part;
+
+	part = malloc(hdrSize + half * sizeof(uint64_t));
+	if (part == NULL) {
+		return -ENOMEM;
+	}
+
+	ret = cache_exportHot(bench.cache, part, hdrSize + half * sizeof(uint64_t));
+	if (ret != (ssize_t)(hdrSize + half * sizeof(uint64_t))) {
+		fprintf(stderr, "cache-bench: export into %zu B blob returned %zd\n", hdrSize + half * sizeof(uint64_t), ret);
+		free(part);
+		return -1;
+	}
+
+	for (i = 0; i < half; ++i) {
+		if (bench_hotAddr(part, hdrSize, i) != bench_hotAddr(blob, hdrSize, i)) {
+			fprintf(stderr, "cache-bench: partial export differs at entry %zu\n", i);
+			free(part);
+			return -1;
+		}
+	}
+
+	free(part);
+
+	return 0;
+}
+
+
+/* Corrupted header and blob shorter than its entry count are rejected */
+static int bench_checkRejects(const unsigned char *blob, ssize_t size, size_t hdrSize)
+{
+	int err = 0;
+	unsigned char *bad;
+
+	bad = malloc(size);
+	if (bad == NULL) {
+		return -ENOMEM;
+	}
+
+	memcpy(bad, blob, size);
+	bad[0] ^= 0xff;
+	if (cache_importHot(bench.cache, bad, size) != -EINVAL) {
+		fprintf(stderr, "cache-bench: import of corrupted blob not rejected\n");
+		err = -1;
+	}
+
+	if (size > (ssize_t)hdrSize && cache_importHot(bench.cache, blob, size - 1) != -EINVAL) {
+		fprintf(stderr, "cache-bench: import of truncated blob not rejected\n");
+		err = -1;
+	}
+
+	free(bad);
+
+	return err;
+}
+
+
+/* Every line preloaded by restarted cache has to overlap line exported by the old one */
+static int bench_checkImported(const unsigned char *blob, ssize_t size, size_t hdrSize, size_t oldLine, size_t newLine)
+{
+	int err = 0;
+	size_t i, j, n, count = (size - hdrSize) / sizeof(uint64_t);
+	ssize_t ret;
+	uint64_t addr;
+	unsigned char *out;
+
+	ret = cache_exportHot(bench.cache, NULL, 0);
+	out = malloc(ret);
+	if (out == NULL) {
+		return -ENOMEM;
+	}
+
+	ret = cache_exportHot(bench.cache, out, ret);
+	n = (ret < (ssize_t)hdrSize) ? 0 : (ret - hdrSize) / sizeof(uint64_t);
+
+	for (i = 0; i < n && err == 0; ++i) {
+		addr = bench_hotAddr(out, hdrSize, i);
+		for (j = 0; j < count; ++j) {
+			if (addr < bench_hotAddr(blob, hdrSize, j) + oldLine && bench_hotAddr(blob, hdrSize, j) < addr + newLine) {
+				break;
+			}
+		}
+
+		if (j == count) {
+			fprintf(stderr, "cache-bench: line 0x%llx preloaded but not exported\n", (unsigned long long)addr);
+			err = -1;
+		}
+	}
+
+	if (count > 0 && n == 0) {
+		fprintf(stderr, "cache-bench: no line preloaded out of %zu exported\n", count);
+		err = -1;
+	}
+
+	free(out);
+
+	return err;
+}
+
+
+/* Restarts cache with hot lines of the old one preloaded, as after reboot, checking blob handling in verify mode */
+static int bench_restart(const cache_ops_t *ops, size_t lineSize, size_t linesCnt, const cache_opts_t *opts)
+{
+	int err;
+	ssize_t size;
+	size_t hdrSize, newLine = (bench.restartLine != 0) ? bench.restartLine : lineSize;
+	unsigned char *blob;
+
+	size = cache_exportHot(bench.cache, NULL, 0);
+	hdrSize = size - linesCnt * sizeof(uint64_t);
+	blob = malloc(size);
+	if (blob == NULL) {
+		return -ENOMEM;
+	}
+
+	size = cache_exportHot(bench.cache, blob, size);
+	err = (size < 0) ? (int)size : 0;
+	if (err == 0 && bench.verify != 0) {
+		err = bench_checkPartial(blob, size, hdrSize);
+	}
+
+	if (cache_deinit(bench.cache) < 0 && err == 0) {
+		err = -EIO;
+	}
+	bench.cache = NULL;
+	if (err < 0) {
+		free(blob);
+		return err;
+	}
+
+	/* Restarted cache keeps capacity */
+	bench.cache = cache_initEx(bench.dev.size, newLine, linesCnt * lineSize / newLine, ops, opts);
+	if (bench.cache == NULL) {
+		free(blob);
+		return -ENOMEM;
+	}
+
+	if (bench.verify != 0) {
+		err = bench_checkRejects(blob, size, hdrSize);
+	}
+
+	if (err == 0) {
+		err = cache_importHot(bench.cache, blob, size);
+	}
+
+	if (err == 0 && bench.verify != 0) {
+		err = bench_checkImported(blob, size, hdrSize, lineSize, newLine);
+	}
+	free(blob);
+
+	return err;
+}
+
+
+/* Runs workload against single cache configuration and prints its result row */
+static int bench_config(size_t lineSize, size_t linesCnt, unsigned int policy, bench_thread_t *thrs, pthread_t *tids)
+{
+	size_t i, maxLen = 0;
+	uint64_t base, size;
+	double elapsed;
+	pthread_t resizer;
+	cache_stats_t stats;
+	cache_ops_t ops = {
+		.readCb = bench_read,
+		.writeCb = bench_write,
+		.ctx = &bench.dev,
+		.readvCb = bench_readv,
+		.writevCb = bench_writev,
+	};
+	cache_opts_t opts = bench.opts;
+
+	if (bench.dev.nthreads > 0) {
+		ops.readAsyncCb = bench_readAsync;
+		ops.writeAsyncCb = bench_writeAsync;
+	}
+	if (bench.noVec != 0) {
+		ops.readvCb = NULL;
+		ops.writevCb = NULL;
+	}
+	opts.replPolicy = policy;
+
+	printf("%8zu %8zu %6s %4zu ", lineSize, linesCnt, bench_policyNames[policy], bench.nthreads);
+	fflush(stdout);
+
+	/* Zipfian ranks cover slice of single thread */
+	if (bench.mode == bench_zipf) {
+		bench_slice(&thrs[0], &base, &size);
+		if (bench_zipfInit(size / bench.reqSize) < 0) {
+			printf("  out of memory\n");
+			return -1;
+		}
+	}
+
+	bench.cache = cache_initEx(bench.dev.size, lineSize, linesCnt, &ops, &opts);
+	if (bench.cache == NULL) {
+		printf("  init failed\n");
+		free(bench.zipfCdf);
+		bench.zipfCdf = NULL;
+		return 0;
+	}
+
+	for (i = 0; i < bench.traceLen; ++i) {
+		if (bench.trace[i].len > maxLen) {
+			maxLen = bench.trace[i].len;
+		}
+	}
+	if (bench.reqSize > maxLen) {
+		maxLen = bench.reqSize;
+	}
+	if (BENCH_TEAR_BLOCK > maxLen) {
+		maxLen = BENCH_TEAR_BLOCK;
+	}
+
+	for (i = 0; i < bench.nthreads; ++i) {
+		thrs[i].id = i;
+		thrs[i].rng = (bench.seed + i) * 0x9e3779b97f4a7c15ULL | 1;
+		thrs[i].seqAddr = (bench.verify != 0 || bench.disjoint != 0) ? 0 : (bench.dev.size / bench.nthreads) * i;
+		thrs[i].seqAddr -= thrs[i].seqAddr % bench.reqSize;
+		thrs[i].tracePos = (bench.traceLen != 0) ? i % bench.traceLen : 0;
+		thrs[i].buf = malloc(maxLen);
+		thrs[i].chk = malloc(maxLen);
+		if (thrs[i].buf == NULL || thrs[i].chk == NULL) {
+			fprintf(stderr, "cache-bench: out of memory\n");
+			atomic_fetch_add(&bench.errors, 1);
+		}
+		else {
+			memset(thrs[i].buf, 0xa5, maxLen);
+		}
+	}
+
+	if (atomic_load(&bench.errors) == 0 && bench.warmup > 0) {
+		bench_spawn(thrs, tids, bench_warmupThread);
+	}
+
+	if (atomic_load(&bench.errors) == 0 && bench.restart != 0 && bench_restart(&ops, lineSize, linesCnt, &opts) < 0) {
+		fprintf(stderr, "cache-bench: warm restart failed\n");
+		atomic_fetch_add(&bench.errors, 1);
+	}
+
+	if (bench.cache == NULL) {
+		printf("  failed\n");
+		free(bench.zipfCdf);
+		bench.zipfCdf = NULL;
+		return -1;
+	}
+	cache_resetStats(bench.cache);
+	bench.scanHits = 0;
+	bench.scanMisses = 0;
+
+	elapsed = bench_now();
+	if (atomic_load(&bench.errors) == 0 && bench.nResizeCnts != 0) {
+		atomic_store(&bench.resizeStop, 0);
+		if (pthread_create(&resizer, NULL, bench_resizeThread, NULL) != 0) {
+			fprintf(stderr, "cache-bench: failed to create thread\n");
+			atomic_fetch_add(&bench.errors, 1);
+		}
+		else {
+			bench_spawn(thrs, tids, bench_thread);
+			atomic_store(&bench.resizeStop, 1);
+			pthread_join(resizer, NULL);
+		}
+	}
+	else if (atomic_load(&bench.errors) == 0) {
+		bench_spawn(thrs, tids, bench_thread);
+	}
+	elapsed = bench_now() - elapsed;
+
+	cache_getStats(bench.cache, &stats);
+	stats.hits -= bench.scanHits;
+	stats.misses -= bench.scanMisses;
+
+	if (cache_deinit(bench.cache) < 0) {
+		fprintf(stderr, "cache-bench: cache_deinit failed\n");
+		atomic_fetch_add(&bench.errors, 1);
+	}
+	bench.cache = NULL;
+
+	/* Tear workload drops dirty data on invalidation, it checks blocks as they are read instead */
+	if (bench.verify != 0 && bench.mode != bench_tear && atomic_load(&bench.errors) == 0 && memcmp(bench.dev.mem, bench.shadow, bench.dev.size) != 0) {
+		fprintf(stderr, "cache-bench: device content differs after cache_deinit\n");
+		atomic_fetch_add(&bench.errors, 1);
+	}
+
+	for (i = 0; i < bench.nthreads; ++i) {
+		free(thrs[i].buf);
+		free(thrs[i].chk);
+	}
+
+	free(bench.zipfCdf);
+	bench.zipfCdf = NULL;
+
+	if (atomic_load(&bench.errors) != 0) {
+		printf("  failed\n");
+		return -1;
+	}
+
+	printf("%12.0f %7.2f %10llu %10llu %12llu %12llu\n",
+		(double)bench.ops / elapsed,
+		(stats.hits + stats.misses != 0) ? 100.0 * (double)stats.hits / (double)(stats.hits + stats.misses) : 0.0,
+		(unsigned long long)stats.devReads, (unsigned long long)stats.devWrites,
+		(unsigned long long)stats.bytesRead, (unsigned long long)stats.bytesWritten);
+
+	return 0;
+}
+
+
+static int bench_parseSize(const char *str, size_t *size)
+{
+	char *end;
+	unsigned long long val;
+
+	errno = 0;
+	val = strtoull(str, &end, 0);
+	if (errno != 0 || end == str) {
+		return -1;
+	}
+
+	switch (*end) {
+		case 'k':
+		case 'K':
+			val <<= 10;
+			end++;
+			break;
+
+		case 'm':
+		case 'M':
+			val <<= 20;
+			end++;
+			break;
+
+		case 'g':
+		case 'G':
+			val <<= 30;
+			end++;
+			break;
+
+		default:
+			break;
+	}
+
+	if (*end != '\0') {
+		return -1;
+	}
+
+	*size = (size_t)val;
+
+	return 0;
+}
+
+
+static int bench_parseSizes(char *str, size_t *sizes, size_t *n)
+{
+	char *tok;
+
+	for (*n = 0, tok = strtok(str, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (*n == BENCH_LIST_MAX || bench_parseSize(tok, &sizes[*n]) < 0 || sizes[*n] == 0) {
+			return -1;
+		}
+		(*n)++;
+	}
+
+	return (*n == 0) ? -1 : 0;
+}
+
+
+static int bench_parsePolicies(char *str)
+{
+	char *tok;
+	unsigned int i;
+
+	for (bench.nPolicies = 0, tok = strtok(str, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		for (i = 0; i < sizeof(bench_policyNames) / sizeof(bench_policyNames[0]); ++i) {
+			if (strcasecmp(tok, bench_policyNames[i]) == 0) {
+				break;
+			}
+		}
+
+		if (bench.nPolicies == BENCH_LIST_MAX || i == sizeof(bench_policyNames) / sizeof(bench_policyNames[0])) {
+			return -1;
+		}
+		bench.policies[bench.nPolicies++] = i;
+	}
+
+	return (bench.nPolicies == 0) ? -1 : 0;
+}
+
+
+static int bench_loadTrace(const char *path)
+{
+	FILE *f;
+	char line[256], op;
+	unsigned long long addr, len;
+	size_t lineNo = 0, cap = 0;
+	bench_op_t *ops;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "cache-bench: cannot open %s\n", path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineNo++;
+
+		if (sscanf(line, " %c", &op) != 1 || op == '#') {
+			continue;
+		}
+
+		if (sscanf(line, " %c %lli %lli", &op, (long long *)&addr, (long long *)&len) != 3 ||
+				(op != 'r' && op != 'w' && op != 'f') || len == 0 || addr + len > bench.dev.size) {
+			fprintf(stderr, "cache-bench: %s:%zu: invalid access\n", path, lineNo);
+			fclose(f);
+			return -1;
+		}
+
+		if (bench.traceLen == cap) {
+			cap = (cap == 0) ? 1024 : 2 * cap;
+			ops = realloc(bench.trace, cap * sizeof(bench_op_t));
+			if (ops == NULL) {
+				fprintf(stderr, "cache-bench: out of memory\n");
+				fclose(f);
+				return -1;
+			}
+			bench.trace = ops;
+		}
+
+		bench.trace[bench.traceLen].op = op;
+		bench.trace[bench.traceLen].addr = addr;
+		bench.trace[bench.traceLen].len = len;
+		bench.traceLen++;
+	}
+
+	fclose(f);
+
+	if (bench.traceLen == 0) {
+		fprintf(stderr, "cache-bench: %s holds no accesses\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int bench_devInit(size_t nthreads)
+{
+	size_t i;
+
+	bench.dev.mem = malloc(bench.dev.size);
+	if (bench.dev.mem == NULL) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < bench.dev.size; ++i) {
+		bench.dev.mem[i] = (unsigned char)(i * 31 + (i >> 9));
+	}
+
+	for (i = 0; bench.mode == bench_tear && i + BENCH_TEAR_BLOCK <= bench.dev.size; i += BENCH_TEAR_BLOCK) {
+		bench_tearFill(bench.dev.mem + i, i, (unsigned char)(i / BENCH_TEAR_BLOCK));
+	}
+
+	if (bench.verify != 0) {
+		bench.shadow = malloc(bench.dev.size);
+		if (bench.shadow == NULL) {
+			return -ENOMEM;
+		}
+		memcpy(bench.shadow, bench.dev.mem, bench.dev.size);
+	}
+
+	pthread_mutex_init(&bench.dev.lock, NULL);
+	pthread_cond_init(&bench.dev.cond, NULL);
+
+	if (nthreads == 0) {
+		return 0;
+	}
+
+	bench.dev.threads = malloc(nthreads * sizeof(pthread_t));
+	if (bench.dev.threads == NULL) {
+		return -ENOMEM;
+	}
+
+	for (bench.dev.nthreads = 0; bench.dev.nthreads < nthreads; ++bench.dev.nthreads) {
+		if (pthread_create(&bench.dev.threads[bench.dev.nthreads], NULL, bench_devThread, &bench.dev) != 0) {
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+
+static void bench_devDone(void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&bench.dev.lock);
+	bench.dev.stop = 1;
+	pthread_cond_broadcast(&bench.dev.cond);
+	pthread_mutex_unlock(&bench.dev.lock);
+
+	for (i = 0; i < bench.dev.nthreads; ++i) {
+		pthread_join(bench.dev.threads[i], NULL);
+	}
+
+	free(bench.dev.threads);
+	free(bench.dev.mem);
+	free(bench.shadow);
+}
+
+
+static void bench_usage(const char *progname)
+{
+	printf("Usage: %s [options]\n", progname);
+	printf("Cache configurations (lists are comma separated, every combination is run):\n");
+	printf("\t-l <sizes>    line sizes (default 512)\n");
+	printf("\t-n <counts>   line counts (default 1024)\n");
+	printf("\t-p <policies> replacement policies: lru, clock, 2q (default lru)\n");
+	printf("\t-a <ways>     lines per set, full for single set (default %d)\n", LIBCACHE_WAYS_DEFAULT);
+	printf("\t-L <locks>    set locks (default %d)\n", LIBCACHE_LOCKS_DEFAULT);
+	printf("\t-i <lines>    max consecutive lines per device access\n");
+	printf("\t-A <lines>    read-ahead window\n");
+	printf("\t-k <size>     sector size\n");
+	printf("\t-b <size>     transfers of at least size bypass cache\n");
+	printf("\t-y            write through instead of write back\n");
+	printf("\t-v            no vectored device callbacks, multi-line transfers are staged\n");
+	printf("\t-F            read hits without set lock\n");
+	printf("\t-Z <counts>   line counts cache is resized to in turn while measured workload runs\n");
+	printf("Device:\n");
+	printf("\t-d <size>     device size (default 16m)\n");
+	printf("\t-R <us>       latency of read callback\n");
+	printf("\t-W <us>       latency of write callback\n");
+	printf("\t-q <depth>    asynchronous callbacks, served by depth device threads\n");
+	printf("\t-j <pct>      percentage of asynchronous requests rejected or transferred partially\n");
+	printf("Workload:\n");
+	printf("\t-m <mode>     seq, rand, zipf, hot, mix or tear (default rand)\n");
+	printf("\t-T <file>     replay trace of \"<r|w|f> <addr> <len>\" lines instead\n");
+	printf("\t-o <ops>      measured operations (default 100000)\n");
+	printf("\t-u <ops>      warm-up operations, not measured (default 0)\n");
+	printf("\t-H            restart cache after warm-up, preloading its exported hot lines\n");
+	printf("\t-E <size>     line size of restarted cache, line count keeps its capacity (default the same)\n");
+	printf("\t-s <size>     request size of synthetic workload, max one (or total of segments) in mix (default 512)\n");
+	printf("\t-w <pct>      percentage of writes (default 30)\n");
+	printf("\t-f <pct>      percentage of range flushes (default 0)\n");
+	printf("\t-z <theta>    zipf skew (default 0.99)\n");
+	printf("\t-x <pct>      percentage of requests going to hot region (default 75)\n");
+	printf("\t-X <size>     hot region size (default 1/16 of range)\n");
+	printf("\t-r <size>     range of synthetic workload, from beginning of slice (default whole slice)\n");
+	printf("\t-C <ops>      read whole device every ops operations, not counted in hit ratio (single thread)\n");
+	printf("\t-t <threads>  client thread counts, list runs every configuration with each (default 1)\n");
+	printf("\t-D            every thread accesses its own slice of device\n");
+	printf("\t-S <seed>     random seed (default 1)\n");
+	printf("\t-V            verify data read against expected device content (implies -D)\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c, err = 0;
+	size_t i, j, k, t, depth = 0, val, maxThreads = 0;
+	char *end, *tracePath = NULL;
+	bench_thread_t *thrs;
+	pthread_t *tids;
+
+	bench.dev.size = 16 << 20;
+	bench.lineSizes[0] = 512;
+	bench.nLineSizes = 1;
+	bench.linesCnts[0] = 1024;
+	bench.nLinesCnts = 1;
+	bench.policies[0] = LIBCACHE_REPL_LRU;
+	bench.nPolicies = 1;
+	bench.writePolicy = LIBCACHE_WRITE_BACK;
+	bench.mode = bench_rand;
+	bench.ops = 100000;
+	bench.reqSize = 512;
+	bench.writePct = 30;
+	bench.theta = 0.99;
+	bench.hotPct = 75;
+	bench.threadCnts[0] = 1;
+	bench.nThreadCnts = 1;
+	bench.seed = 1;
+	bench.dev.faultRng = 0x2545f4914f6cdd1dULL;
+
+	while ((c = getopt(argc, argv, "l:n:p:a:L:i:A:k:b:yvFZ:d:R:W:q:j:m:T:o:u:HE:s:w:f:z:x:X:r:C:t:DS:Vh")) != -1) {
+		switch (c) {
+			case 'l':
+				err = bench_parseSizes(optarg, bench.lineSizes, &bench.nLineSizes);
+				break;
+
+			case 'n':
+				err = bench_parseSizes(optarg, bench.linesCnts, &bench.nLinesCnts);
+				break;
+
+			case 'p':
+				err = bench_parsePolicies(optarg);
+				break;
+
+			case 'a':
+				if (strcmp(optarg, "full") == 0) {
+					bench.opts.numWays = LIBCACHE_WAYS_FULL;
+				}
+				else {
+					err = bench_parseSize(optarg, &bench.opts.numWays);
+				}
+				break;
+
+			case 'L':
+				err = bench_parseSize(optarg, &bench.opts.numLocks);
+				break;
+
+			case 'i':
+				err = bench_parseSize(optarg, &bench.opts.ioLines);
+				break;
+
+			case 'A':
+				err = bench_parseSize(optarg, &bench.opts.raWindow);
+				break;
+
+			case 'k':
+				err = bench_parseSize(optarg, &bench.opts.sectorSize);
+				break;
+
+			case 'b':
+				err = bench_parseSize(optarg, &bench.opts.bypassSize);
+				break;
+
+			case 'y':
+				bench.writePolicy = LIBCACHE_WRITE_THROUGH;
+				break;
+
+			case 'v':
+				bench.noVec = 1;
+				break;
+
+			case 'F':
+				bench.opts.flags |= LIBCACHE_OPT_FAST_HITS;
+				break;
+
+			case 'Z':
+				err = bench_parseSizes(optarg, bench.resizeCnts, &bench.nResizeCnts);
+				break;
+
+			case 'd':
+				err = bench_parseSize(optarg, &val);
+				bench.dev.size = val;
+				break;
+
+			case 'R':
+				bench.dev.rdLat = strtol(optarg, &end, 0);
+				err = (*end != '\0' || bench.dev.rdLat < 0) ? -1 : 0;
+				break;
+
+			case 'W':
+				bench.dev.wrLat = strtol(optarg, &end, 0);
+				err = (*end != '\0' || bench.dev.wrLat < 0) ? -1 : 0;
+				break;
+
+			case 'q':
+				err = bench_parseSize(optarg, &depth);
+				bench.opts.ioDepth = depth;
+				break;
+
+			case 'j':
+				err = bench_parseSize(optarg, &val);
+				bench.dev.faultPct = (unsigned int)val;
+				err = (err < 0 || val > 100) ? -1 : 0;
+				break;
+
+			case 'm':
+				for (bench.mode = bench_seq; bench.mode < bench_trace; ++bench.mode) {
+					if (strcmp(optarg, bench_modeNames[bench.mode]) == 0) {
+						break;
+					}
+				}
+				err = (bench.mode == bench_trace) ? -1 : 0;
+				break;
+
+			case 'T':
+				tracePath = optarg;
+				break;
+
+			case 'o':
+				err = bench_parseSize(optarg, &bench.ops);
+				break;
+
+			case 'u':
+				err = bench_parseSize(optarg, &bench.warmup);
+				break;
+
+			case 'H':
+				bench.restart = 1;
+				break;
+
+			case 'E':
+				err = bench_parseSize(optarg, &bench.restartLine);
+				break;
+
+			case 's':
+				err = bench_parseSize(optarg, &bench.reqSize);
+				break;
+
+			case 'w':
+				err = bench_parseSize(optarg, &val);
+				bench.writePct = (unsigned int)val;
+				err = (err < 0 || val > 100) ? -1 : 0;
+				break;
+
+			case 'f':
+				err = bench_parseSize(optarg, &val);
+				bench.flushPct = (unsigned int)val;
+				err = (err < 0 || val > 100) ? -1 : 0;
+				break;
+
+			case 'z':
+				bench.theta = strtod(optarg, &end);
+				err = (*end != '\0' || bench.theta <= 0) ? -1 : 0;
+				break;
+
+			case 'x':
+				err = bench_parseSize(optarg, &val);
+				bench.hotPct = (unsigned int)val;
+				err = (err < 0 || val > 100) ? -1 : 0;
+				break;
+
+			case 'X':
+				err = bench_parseSize(optarg, &bench.hotSize);
+				break;
+
+			case 'r':
+				err = bench_parseSize(optarg, &bench.range);
+				break;
+
+			case 'C':
+				err = bench_parseSize(optarg, &bench.scanOps);
+				break;
+
+			case 't':
+				err = bench_parseSizes(optarg, bench.threadCnts, &bench.nThreadCnts);
+				break;
+
+			case 'D':
+				bench.disjoint = 1;
+				break;
+
+			case 'S':
+				err = bench_parseSize(optarg, &val);
+				bench.seed = val;
+				break;
+
+			case 'V':
+				bench.verify = 1;
+				break;
+
+			case 'h':
+				bench_usage(argv[0]);
+				return EXIT_SUCCESS;
+
+			default:
+				err = -1;
+				break;
+		}
+
+		if (err < 0) {
+			bench_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < bench.nThreadCnts; ++i) {
+		if (bench.threadCnts[i] > maxThreads) {
+			maxThreads = bench.threadCnts[i];
+		}
+	}
+
+	/* Block spanning lines may be read partially updated */
+	for (i = 0; i < bench.nLineSizes && bench.mode == bench_tear; ++i) {
+		if (bench.lineSizes[i] < BENCH_TEAR_BLOCK) {
+			fprintf(stderr, "cache-bench: tear workload needs lines of at least %d B\n", BENCH_TEAR_BLOCK);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (bench.reqSize == 0 || bench.ops == 0 || bench.writePct + bench.flushPct > 100 || bench.dev.size < maxThreads * bench.reqSize ||
+		(bench.mode == bench_tear && bench.dev.size < 32 * BENCH_TEAR_BLOCK)) {
+		fprintf(stderr, "cache-bench: invalid workload parameters\n");
+		return EXIT_FAILURE;
+	}
+
+	if (bench.scanOps != 0 && maxThreads > 1) {
+		fprintf(stderr, "cache-bench: scans can be run with single thread only\n");
+		return EXIT_FAILURE;
+	}
+
+	if (tracePath != NULL) {
+		bench.mode = bench_trace;
+		if (bench_loadTrace(tracePath) < 0) {
+			return EXIT_FAILURE;
+		}
+
+		if (bench.verify != 0 && maxThreads > 1) {
+			fprintf(stderr, "cache-bench: trace can be verified with single thread only\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Sleeps of a few microseconds are not rounded up to default timer slack */
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+	if (bench_devInit(depth) < 0) {
+		fprintf(stderr, "cache-bench: device initialization failed\n");
+		bench_devDone();
+		return EXIT_FAILURE;
+	}
+
+	thrs = calloc(maxThreads, sizeof(bench_thread_t));
+	tids = calloc(maxThreads, sizeof(pthread_t));
+	if (thrs == NULL || tids == NULL) {
+		fprintf(stderr, "cache-bench: out of memory\n");
+		free(thrs);
+		free(tids);
+		bench_devDone();
+		return EXIT_FAILURE;
+	}
+
+	if (bench.mode == bench_trace) {
+		printf("# workload trace %s (%zu accesses)", tracePath, bench.traceLen);
+	}
+	else if (bench.mode == bench_mix) {
+		printf("# workload mix, unaligned requests up to %zu B", bench.reqSize);
+	}
+	else if (bench.mode == bench_tear) {
+		printf("# workload tear, %d B blocks rewritten, invalidated and evicted by thread 0, read by the others", BENCH_TEAR_BLOCK);
+	}
+	else {
+		printf("# workload %s, %zu B requests, %u%% writes, %u%% flushes", bench_modeNames[bench.mode], bench.reqSize, bench.writePct, bench.flushPct);
+		if (bench.mode == bench_zipf) {
+			printf(", theta %.2f", bench.theta);
+		}
+		else if (bench.mode == bench_hot) {
+			printf(", %u%% hot", bench.hotPct);
+		}
+		if (bench.range != 0) {
+			printf(", range %zu B", bench.range);
+		}
+	}
+	if (bench.scanOps != 0) {
+		printf(", device scan every %zu ops", bench.scanOps);
+	}
+	if (bench.nResizeCnts != 0) {
+		printf(", resized every %d us", BENCH_RESIZE_US);
+	}
+	printf(", %zu ops%s\n", bench.ops, ((bench.verify != 0 || bench.disjoint != 0) && bench.mode != bench_tear) ? ", disjoint slices per thread" : "");
+	printf("# device %llu B, latency read %ld us write %ld us, %s callbacks", (unsigned long long)bench.dev.size,
+		bench.dev.rdLat, bench.dev.wrLat, (depth > 0) ? "async" : "sync");
+	if (depth > 0 && bench.dev.faultPct != 0) {
+		printf(", %u%% faults", bench.dev.faultPct);
+	}
+	printf("\n");
+	printf("%8s %8s %6s %4s %12s %7s %10s %10s %12s %12s\n", "line", "lines", "policy", "thr", "ops/s", "hit%", "devReads", "devWrites", "bytesRead", "bytesWritten");
+
+	for (i = 0; i < bench.nLineSizes && err == 0; ++i) {
+		for (j = 0; j < bench.nLinesCnts && err == 0; ++j) {
+			for (k = 0; k < bench.nPolicies && err == 0; ++k) {
+				for (t = 0; t < bench.nThreadCnts && err == 0; ++t) {
+					bench.nthreads = bench.threadCnts[t];
+					err = bench_config(bench.lineSizes[i], bench.linesCnts[j], bench.policies[k], thrs, tids);
+				}
+			}
+		}
+	}
+
+	free(thrs);
+	free(tids);
+	free(bench.trace);
+	bench_devDone();
+
+	return (err < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
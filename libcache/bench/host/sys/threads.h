@@ -0,0 +1,223 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Cache library benchmark
+ *
+ * Host emulation of libphoenix threads API used by libcache
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOST_SYS_THREADS_H_
+#define _HOST_SYS_THREADS_H_
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+#ifndef EOK
+#define EOK 0
+#endif
+
+
+/* Handles are pointers to host objects, threads are joined by pthread_t */
+typedef uintptr_t handle_t;
+
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} host_resource_t;
+
+
+static inline host_resource_t *host_resource(handle_t h)
+{
+	return (host_resource_t *)h;
+}
+
+
+static inline int host_resourceCreate(handle_t *h, int cond)
+{
+	host_resource_t *r = malloc(sizeof(host_resource_t));
+
+	if (r == NULL) {
+		return -ENOMEM;
+	}
+
+	if (cond != 0) {
+		pthread_condattr_t attr;
+
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&r->cond, &attr);
+		pthread_condattr_destroy(&attr);
+	}
+	else {
+		pthread_mutex_init(&r->mutex, NULL);
+	}
+
+	*h = (handle_t)r;
+
+	return EOK;
+}
+
+
+static inline int mutexCreate(handle_t *h)
+{
+	return host_resourceCreate(h, 0);
+}
+
+
+static inline int condCreate(handle_t *h)
+{
+	return host_resourceCreate(h, 1);
+}
+
+
+/* Mutexes and condition variables are not told apart, both are released without pthread_*_destroy() */
+static inline int resourceDestroy(handle_t h)
+{
+	free(host_resource(h));
+	return EOK;
+}
+
+
+static inline int mutexLock(handle_t h)
+{
+	return -pthread_mutex_lock(&host_resource(h)->mutex);
+}
+
+
+static inline int mutexTry(handle_t h)
+{
+	return (pthread_mutex_trylock(&host_resource(h)->mutex) == 0) ? EOK : -EBUSY;
+}
+
+
+static inline int mutexUnlock(handle_t h)
+{
+	return -pthread_mutex_unlock(&host_resource(h)->mutex);
+}
+
+
+static inline int condSignal(handle_t h)
+{
+	return -pthread_cond_signal(&host_resource(h)->cond);
+}
+
+
+static inline int condBroadcast(handle_t h)
+{
+	return -pthread_cond_broadcast(&host_resource(h)->cond);
+}
+
+
+/* Timeout in microseconds, 0 waits forever */
+static inline int condWait(handle_t h, handle_t m, time_t timeout)
+{
+	struct timespec ts;
+
+	if (timeout == 0) {
+		return -pthread_cond_wait(&host_resource(h)->cond, &host_resource(m)->mutex);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout / 1000000;
+	ts.tv_nsec += (timeout % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	return (pthread_cond_timedwait(&host_resource(h)->cond, &host_resource(m)->mutex, &ts) == 0) ? EOK : -ETIME;
+}
+
+
+/* Monotonic time in microseconds */
+static inline int gettime(time_t *raw, time_t *offs)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (raw != NULL) {
+		*raw = (time_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+	if (offs != NULL) {
+		*offs = 0;
+	}
+
+	return EOK;
+}
+
+
+typedef struct {
+	void (*start)(void *);
+	void *arg;
+} host_thread_t;
+
+
+static inline void *host_threadStart(void *arg)
+{
+	host_thread_t thr = *(host_thread_t *)arg;
+
+	free(arg);
+	thr.start(thr.arg);
+
+	return NULL;
+}
+
+
+/* Priority and caller provided stack are ignored */
+static inline int beginthreadex(void (*start)(void *), unsigned int priority, void *stack, unsigned int stacksz, void *arg, handle_t *id)
+{
+	int err;
+	pthread_t tid;
+	host_thread_t *thr = malloc(sizeof(host_thread_t));
+
+	(void)priority;
+	(void)stack;
+	(void)stacksz;
+
+	if (thr == NULL) {
+		return -ENOMEM;
+	}
+
+	thr->start = start;
+	thr->arg = arg;
+
+	err = pthread_create(&tid, NULL, host_threadStart, thr);
+	if (err != 0) {
+		free(thr);
+		return -err;
+	}
+
+	if (id != NULL) {
+		*id = (handle_t)tid;
+	}
+
+	return EOK;
+}
+
+
+static inline void endthread(void)
+{
+	pthread_exit(NULL);
+}
+
+
+static inline int threadJoin(handle_t tid, time_t timeout)
+{
+	(void)timeout;
+
+	return -pthread_join((pthread_t)tid, NULL);
+}
+
+
+#endif
@@ -15,13 +15,14 @@
 
 #include <sys/list.h>
 #include <sys/threads.h>
+#include <sys/time.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 
 
-#define LIBCACHE_NUM_WAYS   4
 #define LIBCACHE_ADDR_WIDTH 64
 
 
@@ -31,6 +32,8 @@
 
 #define IS_VALID(f) (((f) & (1 << 0)) != 0 ? 1 : 0)
 #define IS_DIRTY(f) (((f) & (1 << 1)) != 0 ? 1 : 0)
+#define IS_BUSY(f)  (((f) & (1 << 2)) != 0 ? 1 : 0)
+#define IS_PREFETCHED(f) (((f) & (1 << 3)) != 0 ? 1 : 0)
 
 #define SET_VALID(f) \
 	do { \
@@ -50,36 +53,300 @@
 		(f) &= ~(1 << 1); \
 	} while (0)
 
+/* Line data is being transferred from/to device with set lock dropped */
+#define SET_BUSY(f) \
+	do { \
+		(f) |= (1 << 2); \
+	} while (0)
+#define CLEAR_BUSY(f) \
+	do { \
+		(f) &= ~(1 << 2); \
+	} while (0)
+
+/* Line was fetched by read-ahead and has not been accessed yet */
+#define SET_PREFETCHED(f) \
+	do { \
+		(f) |= (1 << 3); \
+	} while (0)
+#define CLEAR_PREFETCHED(f) \
+	do { \
+		(f) &= ~(1 << 3); \
+	} while (0)
+
+/* CLOCK: line was accessed since hand last passed it */
+#define IS_REFERENCED(f) (((f) & (1 << 4)) != 0 ? 1 : 0)
+#define SET_REFERENCED(f) \
+	do { \
+		(f) |= (1 << 4); \
+	} while (0)
+#define CLEAR_REFERENCED(f) \
+	do { \
+		(f) &= ~(1 << 4); \
+	} while (0)
+
+/* 2Q: line is in probation FIFO, not in main LRU list */
+#define IS_PROBATION(f) (((f) & (1 << 5)) != 0 ? 1 : 0)
+#define SET_PROBATION(f) \
+	do { \
+		(f) |= (1 << 5); \
+	} while (0)
+#define CLEAR_PROBATION(f) \
+	do { \
+		(f) &= ~(1 << 5); \
+	} while (0)
+
 
 #define LOG2(x) ((uint8_t)(8 * sizeof(unsigned long) - __builtin_clzl((x)) - 1))
 
 
+#define LIBCACHE_RA_STREAMS 4 /* Number of tracked sequential streams */
+#define LIBCACHE_RA_TRIGGER 2 /* Number of consecutive sequential reads which start read-ahead */
+#define LIBCACHE_RA_QUEUE   8 /* Number of pending read-ahead requests */
+
+#define LIBCACHE_GHOST_NONE ((uint64_t)-1) /* Empty 2Q ghost entry, never a valid tag */
+
+#define LIBCACHE_SCAN_BATCH 32 /* Number of line addresses collected per pass over resident lists */
+
+#define LIBCACHE_ADVICE_MAX 8 /* Number of ranges with persistent access pattern advice */
+
+#define LIBCACHE_STAGES 4 /* Max number of bounce buffers, multi-line transfers wait for one only when all are in use */
+
+#define LIBCACHE_BYPASS_LINES 64 /* Max number of lines read by bypass with single device access, lines dirty before it are tracked in one mask */
+
+#define LIBCACHE_RESIZE_TRIES 8 /* Number of write-backs of lines not fitting resized cache before giving up */
+
+#define LIBCACHE_POOL_SCAN 8     /* Number of lines of stripe compared by pool reclaim */
+#define LIBCACHE_POOL_WAIT 10000 /* Max time (us) waiting for pool buffer if there is nothing to reclaim */
+
+#define LIBCACHE_FLUSH_BACKOFF 10000 /* Time (us) flusher sleeps after a pass which wrote nothing back, if dirty age is not set */
+
+#define LIBCACHE_FETCH_DEMAND    0 /* Fetched lines are left busy and owned by the caller */
+#define LIBCACHE_FETCH_READAHEAD 1
+#define LIBCACHE_FETCH_WARM      2 /* Preload of lines exported by cache_exportHot() */
+
+#define LIBCACHE_HOT_MAGIC   0x54484c43 /* "CLHT" */
+#define LIBCACHE_HOT_VERSION 1
+#define LIBCACHE_HOT_NONE    ((uint64_t)-1) /* Unused rank of set, never a line address */
+
+/* Tests dirty bit of sector s counted from the beginning of run of lines with spl sectors each */
+#define LIBCACHE_SECTOR_DIRTY(run, spl, s) ((((run)[(s) / (spl)]->dirtyMask >> ((s) % (spl))) & 1) != 0)
+
+
+/* Tag fingerprints are packed into machine words and scanned a word at a time */
+typedef unsigned long cachefp_t;
+
+#define LIBCACHE_FP_PER_WORD    sizeof(cachefp_t)
+#define LIBCACHE_FP_WORDS(ways) (((ways) + LIBCACHE_FP_PER_WORD - 1) / LIBCACHE_FP_PER_WORD)
+#define LIBCACHE_FP_LSB         (~(cachefp_t)0 / 0xff)
+#define LIBCACHE_FP_MSB         (LIBCACHE_FP_LSB << 7)
+
+/* Marks zero bytes of x, only the lowest mark is exact (higher ones may be false positives) */
+#define LIBCACHE_FP_ZEROS(x) (((x) - LIBCACHE_FP_LSB) & ~(x) & LIBCACHE_FP_MSB)
+
+
 typedef struct cacheline_s cacheline_t;
 
 
 struct cacheline_s {
 	uint64_t tag;
 	cacheline_t *prev, *next; /* Circular doubly linked list */
+	cacheline_t *validPrev, *validNext; /* Resident lines of stripe */
+	cacheline_t *dirtyPrev, *dirtyNext; /* Dirty lines of stripe */
 	void *data;
+	uint64_t validMask; /* Sectors holding data, others are fetched on first read */
+	uint64_t dirtyMask; /* Modified sectors, only these are written back */
+	uint32_t partBeg;   /* Written bytes [partBeg, partEnd) of otherwise invalid dirty sector, */
+	uint32_t partEnd;   /* merged with device data once sector is needed as a whole */
+	time_t dirtyTime;   /* Time of first write since line was clean, kept only for flusher */
+	unsigned int pins;  /* Number of cache_pin() references, pinned line is never evicted */
+	unsigned int stamp; /* Pool clock at last access, kept only for pooled caches */
 	unsigned char flags;
+	atomic_uint seq;      /* Odd while fields read by fast hits are changed, see cache_lineBegin() */
+	atomic_uchar touched; /* Fast hit since line was last touched under set lock */
+};
+
+
+/* Asynchronous device access, lines of run stay busy until it is waited for */
+typedef struct cacheio_s cacheio_t;
+
+
+struct cacheio_s {
+	cacheio_t *next; /* Free requests */
+	cachectx_t *cache;
+	uint64_t addr;                     /* Device address of transfer */
+	uint64_t lineAddr;                 /* Address of first line of run */
+	cacheline_t *run[LIBCACHE_IO_MAX];
+	size_t n;
+	cache_iov_t iov[LIBCACHE_IO_MAX];
+	size_t iovcnt;
+	int write;
+	int done; /* Guarded by ioLock */
+	ssize_t ret;
+};
+
+
+/* Write-backs of range flush in flight */
+typedef struct {
+	cacheio_t *io[LIBCACHE_IO_DEPTH];
+	size_t cnt;
+	int invalidate;
+	int err; /* First error of completed write-backs */
+} cacheflushq_t;
+
+
+typedef struct {
+	handle_t lock;
+	handle_t cond; /* Broadcast when busy line of any set guarded by stripe becomes idle */
+	cache_stats_t stats;
+	cacheline_t *valid; /* Resident lines of sets guarded by stripe */
+	cacheline_t *dirty; /* Dirty lines of sets guarded by stripe, in order of becoming dirty */
+	atomic_ulong fastHits; /* Hits without stripe lock, moved to stats under lock */
+} cachestripe_t;
+
+
+/* Bounce buffer for multi-line transfers without vectored callbacks */
+typedef struct {
+	void *buf;
+	handle_t lock;
+} cachestage_t;
+
+
+/* Counters not related to any set, bumped without lock on every device transfer */
+typedef struct {
+	atomic_uint_fast64_t devReads;
+	atomic_uint_fast64_t devWrites;
+	atomic_uint_fast64_t bytesRead;
+	atomic_uint_fast64_t bytesWritten;
+	atomic_uint_fast64_t bypassed;
+	atomic_uint_fast64_t flushes;
+} cachecounters_t;
+
+
+/* Line aligned range with advice applied to lines allocated or read later */
+typedef struct {
+	uint64_t beg, end;
+	int hint;
+} cacheadvice_t;
+
+
+struct cachepool_s {
+	handle_t lock;
+	handle_t cond; /* Broadcast when buffer is freed or write-back for other cache ends */
+	void *arena;
+	void **free; /* Free buffers, freeCnt first entries */
+	size_t freeCnt;
+	size_t linesCnt;
+	size_t lineSize;
+	size_t minSum;       /* Sum of poolMin of members */
+	cachectx_t *members; /* Caches using pool, guarded by lock as their pool fields */
+	atomic_uint clock;   /* Advanced by every line allocation of members */
 };
 
 
+/* Line considered for reclaim, its stripe is locked */
+typedef struct {
+	cachectx_t *cache;
+	cachestripe_t *stripe;
+	cacheline_t *line;
+} cachepoolcand_t;
+
+
+/* Header of blob produced by cache_exportHot(), followed by count line addresses */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t lineSize;
+	uint32_t count;
+} cachehothdr_t;
+
+
+typedef struct {
+	uint64_t next;      /* Line expected to be read next */
+	uint64_t issued;    /* End of lines requested from read-ahead thread */
+	unsigned int run;   /* Number of sequential reads, 0 marks unused stream */
+	unsigned int stamp; /* Time of last access */
+} cachestream_t;
+
+
+typedef struct {
+	handle_t lock;
+	handle_t cond;
+	handle_t tid;
+	int stop;
+	void *stack;
+} cachethread_t;
+
+
+typedef struct {
+	cachethread_t thr;
+
+	size_t window;
+	unsigned int stamp;
+	cachestream_t streams[LIBCACHE_RA_STREAMS];
+
+	struct {
+		uint64_t beg, end; /* Range of lines to prefetch */
+	} queue[LIBCACHE_RA_QUEUE];
+	size_t head;
+	size_t used;
+} cachera_t;
+
+
+typedef struct {
+	cachethread_t thr;
+
+	unsigned int high; /* Number of dirty lines which wakes flusher up */
+	unsigned int low;  /* Number of dirty lines at which flusher stops */
+	time_t age;        /* Max time line may stay dirty (us), 0 - unlimited */
+	int err;           /* Error of the last failed write-back, reset by a pass without errors */
+} cacheflusher_t;
+
+
 typedef struct {
-	cacheline_t *timestamps;
-	cacheline_t *tags[LIBCACHE_NUM_WAYS];
-	cacheline_t lines[LIBCACHE_NUM_WAYS];
+	cacheline_t *timestamps; /* LRU list, head is the least recently used line */
+	cachefp_t *fps;          /* Tag fingerprint per way, 0 marks a free way */
+	cacheline_t *lines;
 	size_t count;
+
+	size_t hand; /* CLOCK */
+
+	cacheline_t *probation; /* 2Q, lines referenced once, oldest first */
+	size_t probCnt;
+	uint64_t *ghosts; /* 2Q, tags recently evicted from probation */
+	size_t ghostHead;
 } cacheset_t;
 
 
+/* Replacement policy, all callbacks are called with set lock held */
+typedef struct {
+	void (*insert)(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr);
+	void (*touch)(cacheset_t *setPtr, cacheline_t *linePtr);
+	void (*demote)(cacheset_t *setPtr, cacheline_t *linePtr); /* Makes line the first candidate for eviction */
+	cacheline_t *(*victim)(const cachectx_t *cache, cacheset_t *setPtr); /* NULL if all lines are busy or pinned */
+	void (*remove)(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr, int evict);
+	size_t (*order)(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t **lines); /* Valid lines, most recently used first */
+} cachereplops_t;
+
+
 struct cachectx_s {
 	cacheset_t *sets;
+	cacheline_t *lines; /* Lines of all sets, numWays consecutive lines per set */
+	cachefp_t *fps;     /* Fingerprints of all sets, fpWords consecutive words per set */
+	uint64_t *ghosts;   /* 2Q ghost tags of all sets, ghostsCnt consecutive entries per set */
+	void *arena;        /* Preallocated line buffers, NULL if lines are allocated on demand */
+	size_t lineAlign;   /* Alignment of arena line buffers */
 
 	size_t srcMemSize;
 	size_t lineSize;
 	size_t linesCnt;
 	size_t numSets;
+	size_t numWays;
+	size_t fpWords;
+	int fullAssoc; /* LIBCACHE_WAYS_FULL, single set is resized along with cache */
+
+	const cachereplops_t *repl;
+	size_t probMax;   /* 2Q, probation FIFO size limit */
+	size_t ghostsCnt; /* 2Q, number of ghost tags per set */
 
 	uint64_t tagMask;
 	uint64_t setMask;
@@ -90,11 +357,59 @@ struct cachectx_s {
 	uint8_t tagBitsNum;
 
 	cache_ops_t ops;
-
-	handle_t lock;
+	int fastHits; /* LIBCACHE_OPT_FAST_HITS */
+
+	cachestripe_t *stripes; /* Set i is guarded by stripes[i & stripeMask] */
+	size_t stripeMask;
+
+	cachera_t *ra;           /* Read-ahead engine, NULL if disabled */
+	cacheflusher_t *flusher; /* Background write-back, NULL if disabled */
+	atomic_uint dirtyCnt;
+	atomic_uint validCnt;
+
+	cachecounters_t counters;
+
+	size_t ioLines;
+	size_t progUnit;
+	uint8_t sectorBits;   /* Valid/dirty tracking granularity, at most 64 sectors per line */
+	uint64_t sectorsMask; /* All sectors of line */
+	size_t bypassSize; /* Transfers of at least this size skip line buffers */
+	cachestage_t *stages; /* NULL if vectored callbacks are set or transfers are not coalesced */
+	size_t stagesCnt;
+	void *merge; /* Device data of sector merged with partial extent, NULL without sector masks */
+	handle_t mergeLock;
+
+	size_t ioDepth;     /* Number of async requests, 0 if async callbacks are not used */
+	cacheio_t *ioPool;
+	cacheio_t *ioFree;
+	handle_t ioLock;
+	handle_t ioCond; /* Broadcast on completion of any request */
+
+	cacheadvice_t advice[LIBCACHE_ADVICE_MAX]; /* Disjoint, changed under adviceLock */
+	atomic_uint adviceCnt;
+	atomic_uint adviceSeq; /* Odd while advice is being changed, lookup retries if it changed meanwhile */
+	handle_t adviceLock;
+
+	cachepool_t *pool; /* Source of line buffers, NULL if cache allocates its own */
+	cachectx_t *poolPrev, *poolNext;
+	size_t poolUsed;       /* Number of buffers taken from pool */
+	size_t poolMin;
+	size_t poolMax;
+	size_t poolStripe;     /* Next stripe scanned by reclaim */
+	unsigned int poolRefs; /* Write-backs of other members in progress on cache */
+
+	atomic_uint active;  /* Calls accessing sets, cache_resize() waits until there are none */
+	atomic_int resizing; /* New calls wait until cache_resize() lets them in */
+	handle_t gateLock;
+	handle_t gateCond;   /* Broadcast when last call leaves or calls are let in */
+	handle_t resizeLock; /* Serializes cache_resize() */
 };
 
-static void cache_invalidateLine(cacheset_t *setPtr, cacheline_t *linePtr);
+static void cache_invalidateLine(cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr);
+static int cache_replInit(cachectx_t *cache, unsigned int policy);
+static void cache_raThread(void *arg);
+static void cache_flusherThread(void *arg);
+static int cache_flushRange(cachectx_t *cache, uint64_t addr, const uint64_t end, int invalidate);
 
 static uint64_t cache_generateMask(int numBits)
 {
@@ -102,573 +417,4721 @@ static uint64_t cache_generateMask(int numBits)
 }
 
 
-cachectx_t *cache_init(size_t srcMemSize, size_t lineSize, size_t linesCnt, const cache_ops_t *ops)
+static void cache_freeSets(cachectx_t *cache)
+{
+	size_t i;
+
+	/* Buffers kept by invalid lines for fast hits */
+	if (cache->lines != NULL && cache->arena == NULL && cache->pool == NULL) {
+		for (i = 0; i < cache->linesCnt; ++i) {
+			free(cache->lines[i].data);
+		}
+	}
+
+	free(cache->sets);
+	free(cache->lines);
+	free(cache->fps);
+	free(cache->ghosts);
+	free(cache->arena);
+
+	cache->sets = NULL;
+	cache->lines = NULL;
+	cache->fps = NULL;
+	cache->ghosts = NULL;
+	cache->arena = NULL;
+}
+
+
+static int cache_allocArena(cachectx_t *cache, size_t lineAlign)
+{
+	size_t i, stride;
+	uintptr_t base;
+
+	if (lineAlign == 0) {
+		lineAlign = sizeof(void *);
+	}
+
+	if ((lineAlign & (lineAlign - 1)) != 0) {
+		return -EINVAL;
+	}
+
+	stride = (cache->lineSize + lineAlign - 1) & ~(lineAlign - 1);
+
+	cache->arena = malloc(stride * cache->linesCnt + lineAlign - 1);
+	if (cache->arena == NULL) {
+		return -ENOMEM;
+	}
+
+	base = ((uintptr_t)cache->arena + lineAlign - 1) & ~(uintptr_t)(lineAlign - 1);
+
+	for (i = 0; i < cache->linesCnt; ++i) {
+		cache->lines[i].data = (void *)(base + i * stride);
+	}
+
+	return EOK;
+}
+
+
+static void cache_destroyLocks(cachectx_t *cache, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		resourceDestroy(cache->stripes[i].cond);
+		resourceDestroy(cache->stripes[i].lock);
+	}
+
+	free(cache->stripes);
+	resourceDestroy(cache->resizeLock);
+	resourceDestroy(cache->gateCond);
+	resourceDestroy(cache->gateLock);
+	resourceDestroy(cache->adviceLock);
+}
+
+
+static int cache_createLocks(cachectx_t *cache, size_t numLocks)
 {
 	int err;
-	cachectx_t *cache = NULL;
+	size_t i;
 
-	if (srcMemSize == 0 || linesCnt == 0 || lineSize == 0) {
-		return NULL;
+	if (numLocks == 0) {
+		numLocks = LIBCACHE_LOCKS_DEFAULT;
 	}
 
-	if (linesCnt % LIBCACHE_NUM_WAYS != 0) {
-		return NULL;
+	/* No point in more locks than sets */
+	if (numLocks > cache->numSets) {
+		numLocks = cache->numSets;
 	}
 
-	cache = malloc(sizeof(cachectx_t));
+	numLocks = (size_t)1 << LOG2(numLocks);
 
-	if (cache != NULL) {
-		cache->srcMemSize = srcMemSize;
-		cache->lineSize = lineSize;
-		cache->linesCnt = linesCnt;
+	err = mutexCreate(&cache->adviceLock);
+	if (err < 0) {
+		return err;
+	}
 
-		cache->numSets = cache->linesCnt / LIBCACHE_NUM_WAYS;
+	err = mutexCreate(&cache->gateLock);
+	if (err < 0) {
+		resourceDestroy(cache->adviceLock);
+		return err;
+	}
 
-		cache->sets = calloc(cache->numSets, sizeof(cacheset_t));
+	err = condCreate(&cache->gateCond);
+	if (err < 0) {
+		resourceDestroy(cache->gateLock);
+		resourceDestroy(cache->adviceLock);
+		return err;
+	}
 
-		if (cache->sets == NULL) {
-			free(cache);
-			cache = NULL;
-		}
-		else {
-			cache->offBitsNum = LOG2(cache->lineSize);
-			cache->setBitsNum = LOG2(cache->numSets);
-			cache->tagBitsNum = LIBCACHE_ADDR_WIDTH - cache->setBitsNum - cache->offBitsNum;
+	err = mutexCreate(&cache->resizeLock);
+	if (err < 0) {
+		resourceDestroy(cache->gateCond);
+		resourceDestroy(cache->gateLock);
+		resourceDestroy(cache->adviceLock);
+		return err;
+	}
 
-			cache->tagMask = cache_generateMask(cache->tagBitsNum);
-			cache->setMask = cache_generateMask(cache->setBitsNum);
-			cache->offMask = cache_generateMask(cache->offBitsNum);
+	cache->stripes = malloc(numLocks * sizeof(cachestripe_t));
+	if (cache->stripes == NULL) {
+		resourceDestroy(cache->resizeLock);
+		resourceDestroy(cache->gateCond);
+		resourceDestroy(cache->gateLock);
+		resourceDestroy(cache->adviceLock);
+		return -ENOMEM;
+	}
 
-			cache->ops = *ops;
+	for (i = 0; i < numLocks; ++i) {
+		memset(&cache->stripes[i].stats, 0, sizeof(cache_stats_t));
+		atomic_init(&cache->stripes[i].fastHits, 0);
+		cache->stripes[i].valid = NULL;
+		cache->stripes[i].dirty = NULL;
 
-			err = mutexCreate(&cache->lock);
-			if (err < 0) {
-				free(cache->sets);
-				free(cache);
-				cache = NULL;
-			}
+		err = mutexCreate(&cache->stripes[i].lock);
+		if (err < 0) {
+			cache_destroyLocks(cache, i);
+			cache->stripes = NULL;
+			return err;
+		}
+
+		err = condCreate(&cache->stripes[i].cond);
+		if (err < 0) {
+			resourceDestroy(cache->stripes[i].lock);
+			cache_destroyLocks(cache, i);
+			cache->stripes = NULL;
+			return err;
 		}
 	}
 
-	return cache;
+	cache->stripeMask = numLocks - 1;
+
+	return EOK;
 }
 
 
-static uint64_t cache_computeAddr(const cachectx_t *cache, uint64_t tag, uint64_t setIndex)
+static void cache_lockStripe(cachestripe_t *stripe)
 {
-	uint64_t temp = (tag << cache->setBitsNum) | setIndex;
-	return temp << cache->offBitsNum;
+	time_t start, end;
+
+	/* Wait time is measured only on contention, uncontended path costs single counter increment */
+	if (mutexTry(stripe->lock) < 0) {
+		gettime(&start, NULL);
+		mutexLock(stripe->lock);
+		gettime(&end, NULL);
+
+		stripe->stats.lockContended++;
+		stripe->stats.lockWaitTime += end - start;
+	}
+
+	stripe->stats.lockAcquires++;
 }
 
 
-static int cache_flushLine(cachectx_t *cache, cacheline_t *linePtr, uint64_t addr)
+static cachestripe_t *cache_lockSet(const cachectx_t *cache, uint64_t setIndex)
 {
-	ssize_t writeCount = 0, position = 0;
-	size_t left = cache->lineSize;
+	cachestripe_t *stripe = &cache->stripes[setIndex & cache->stripeMask];
 
-	if ((linePtr != NULL) && IS_VALID(linePtr->flags) && IS_DIRTY(linePtr->flags)) {
-		while (left > 0) {
-			writeCount = cache->ops.writeCb(addr, (const unsigned char *)linePtr->data + position, left, cache->ops.ctx);
-			if (writeCount <= 0) {
-				return -EIO;
-			}
+	cache_lockStripe(stripe);
+
+	return stripe;
+}
+
+
+static void cache_waitLine(cachestripe_t *stripe)
+{
+	condWait(stripe->cond, stripe->lock, 0);
+}
+
+
+/*
+ * Line identity, flags, valid sectors and their data are changed between cache_lineBegin() and cache_lineEnd()
+ * with set lock held, so fast hit copying line data without the lock can tell if they changed meanwhile
+ */
+static void cache_lineBegin(cacheline_t *linePtr)
+{
+	atomic_store_explicit(&linePtr->seq, atomic_load_explicit(&linePtr->seq, memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+
+static void cache_lineEnd(cacheline_t *linePtr)
+{
+	atomic_store_explicit(&linePtr->seq, atomic_load_explicit(&linePtr->seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+
+/* Makes line busy, its data may change until it is released */
+static void cache_claimLine(cacheline_t *linePtr)
+{
+	cache_lineBegin(linePtr);
+	SET_BUSY(linePtr->flags);
+	cache_lineEnd(linePtr);
+}
+
+
+static void cache_releaseLine(cachestripe_t *stripe, cacheline_t *linePtr)
+{
+	cache_lineBegin(linePtr);
+	CLEAR_BUSY(linePtr->flags);
+	cache_lineEnd(linePtr);
+	condBroadcast(stripe->cond);
+}
+
+
+static void cache_leave(cachectx_t *cache)
+{
+	if (atomic_fetch_sub(&cache->active, 1) == 1 && atomic_load(&cache->resizing) != 0) {
+		mutexLock(cache->gateLock);
+		condBroadcast(cache->gateCond);
+		mutexUnlock(cache->gateLock);
+	}
+}
+
+
+/* Returns -EAGAIN if cache is being resized */
+static int cache_tryEnter(cachectx_t *cache)
+{
+	atomic_fetch_add(&cache->active, 1);
+
+	if (atomic_load(&cache->resizing) != 0) {
+		cache_leave(cache);
+		return -EAGAIN;
+	}
+
+	return EOK;
+}
 
-			left -= writeCount;
-			addr += writeCount;
-			position += writeCount;
+
+/* Every access to sets, except for cache_resize() itself, is made between cache_enter() and cache_leave() */
+static void cache_enter(cachectx_t *cache)
+{
+	while (cache_tryEnter(cache) < 0) {
+		mutexLock(cache->gateLock);
+		while (atomic_load(&cache->resizing) != 0) {
+			condWait(cache->gateCond, cache->gateLock, 0);
 		}
+		mutexUnlock(cache->gateLock);
+	}
+}
 
-		CLEAR_DIRTY(linePtr->flags);
+
+static int cache_allocSets(cachectx_t *cache)
+{
+	size_t i;
+
+	cache->sets = calloc(cache->numSets, sizeof(cacheset_t));
+	cache->lines = calloc(cache->linesCnt, sizeof(cacheline_t));
+	cache->fps = calloc(cache->numSets * cache->fpWords, sizeof(cachefp_t));
+
+	if (cache->sets == NULL || cache->lines == NULL || cache->fps == NULL) {
+		return -ENOMEM;
 	}
 
-	return 0;
+	if (cache->ghostsCnt != 0) {
+		cache->ghosts = malloc(cache->numSets * cache->ghostsCnt * sizeof(uint64_t));
+		if (cache->ghosts == NULL) {
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < cache->numSets * cache->ghostsCnt; ++i) {
+			cache->ghosts[i] = LIBCACHE_GHOST_NONE;
+		}
+	}
+
+	for (i = 0; i < cache->numSets; ++i) {
+		cache->sets[i].lines = &cache->lines[i * cache->numWays];
+		cache->sets[i].fps = &cache->fps[i * cache->fpWords];
+		if (cache->ghosts != NULL) {
+			cache->sets[i].ghosts = &cache->ghosts[i * cache->ghostsCnt];
+		}
+	}
+
+	return EOK;
 }
 
 
-int cache_deinit(cachectx_t *cache)
+static void cache_threadStop(cachethread_t *thr)
+{
+	mutexLock(thr->lock);
+	thr->stop = 1;
+	condSignal(thr->cond);
+	mutexUnlock(thr->lock);
+
+	threadJoin(thr->tid, 0);
+
+	resourceDestroy(thr->cond);
+	resourceDestroy(thr->lock);
+	free(thr->stack);
+}
+
+
+static int cache_threadStart(cachectx_t *cache, cachethread_t *thr, void (*start)(void *), unsigned int prio, size_t stackSz)
 {
 	int err;
 
-	for (size_t i = 0; i < cache->numSets; ++i) {
-		for (size_t j = 0; j < LIBCACHE_NUM_WAYS; ++j) {
-			cacheline_t *linePtr = &(cache->sets[i].lines[j]);
+	thr->stop = 0;
 
-			if (!IS_VALID(linePtr->flags)) {
-				continue;
-			}
+	thr->stack = malloc(stackSz);
+	if (thr->stack == NULL) {
+		return -ENOMEM;
+	}
 
-			if (IS_DIRTY(linePtr->flags)) {
-				uint64_t addr = cache_computeAddr(cache, linePtr->tag, i);
-				err = cache_flushLine(cache, linePtr, addr);
-				if (err < 0) {
-					return err;
-				}
-			}
+	err = mutexCreate(&thr->lock);
+	if (err < 0) {
+		free(thr->stack);
+		return err;
+	}
 
-			cache_invalidateLine(&cache->sets[i], linePtr);
-		}
+	err = condCreate(&thr->cond);
+	if (err < 0) {
+		resourceDestroy(thr->lock);
+		free(thr->stack);
+		return err;
 	}
 
-	err = resourceDestroy(cache->lock);
+	err = beginthreadex(start, prio, thr->stack, stackSz, cache, &thr->tid);
 	if (err < 0) {
+		resourceDestroy(thr->cond);
+		resourceDestroy(thr->lock);
+		free(thr->stack);
 		return err;
 	}
 
-	free(cache->sets);
-	free(cache);
+	return EOK;
+}
+
+
+static void cache_raDeinit(cachectx_t *cache)
+{
+	cache_threadStop(&cache->ra->thr);
+	free(cache->ra);
+	cache->ra = NULL;
+}
+
+
+static int cache_raInit(cachectx_t *cache, size_t window, unsigned int prio, size_t stackSz)
+{
+	int err;
+
+	cache->ra = calloc(1, sizeof(cachera_t));
+	if (cache->ra == NULL) {
+		return -ENOMEM;
+	}
+
+	cache->ra->window = window;
+
+	err = cache_threadStart(cache, &cache->ra->thr, cache_raThread, prio, stackSz);
+	if (err < 0) {
+		free(cache->ra);
+		cache->ra = NULL;
+	}
+
+	return err;
+}
+
+
+static void cache_flusherDeinit(cachectx_t *cache)
+{
+	cache_threadStop(&cache->flusher->thr);
+	free(cache->flusher);
+	cache->flusher = NULL;
+}
+
+
+static int cache_flusherInit(cachectx_t *cache, const cache_opts_t *opts, unsigned int prio, size_t stackSz)
+{
+	int err;
+	cacheflusher_t *fl;
+
+	fl = calloc(1, sizeof(cacheflusher_t));
+	if (fl == NULL) {
+		return -ENOMEM;
+	}
+
+	/* Without high watermark only dirty age triggers write-back */
+	fl->high = (unsigned int)((opts->dirtyHigh != 0) ? opts->dirtyHigh : cache->linesCnt + 1);
+	fl->low = (unsigned int)((opts->dirtyLow != 0 && opts->dirtyLow < fl->high) ? opts->dirtyLow : fl->high / 2);
+	fl->age = opts->dirtyAge;
+
+	cache->flusher = fl;
+
+	err = cache_threadStart(cache, &fl->thr, cache_flusherThread, prio, stackSz);
+	if (err < 0) {
+		free(fl);
+		cache->flusher = NULL;
+	}
+
+	return err;
+}
+
+
+static void cache_freeStages(cachectx_t *cache)
+{
+	size_t i;
+
+	for (i = 0; i < cache->stagesCnt; ++i) {
+		resourceDestroy(cache->stages[i].lock);
+		free(cache->stages[i].buf);
+	}
+
+	free(cache->stages);
+	cache->stages = NULL;
+	cache->stagesCnt = 0;
+}
+
+
+static int cache_allocStage(cachectx_t *cache, size_t ioLines)
+{
+	int err = EOK;
+	size_t i, n;
+
+	if (ioLines > LIBCACHE_IO_MAX) {
+		ioLines = LIBCACHE_IO_MAX;
+	}
+
+	cache->ioLines = (ioLines != 0) ? ioLines : 1;
+
+	if (cache->ioLines == 1 || (cache->ops.readvCb != NULL && cache->ops.writevCb != NULL)) {
+		return EOK;
+	}
+
+	/* One buffer per stripe at most, so transfers of different sets rarely wait for each other's device I/O */
+	n = (cache->stripeMask + 1 < LIBCACHE_STAGES) ? cache->stripeMask + 1 : LIBCACHE_STAGES;
+
+	cache->stages = malloc(n * sizeof(cachestage_t));
+	if (cache->stages == NULL) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n; ++i) {
+		cache->stages[i].buf = malloc(cache->ioLines * cache->lineSize);
+		if (cache->stages[i].buf == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+
+		err = mutexCreate(&cache->stages[i].lock);
+		if (err < 0) {
+			free(cache->stages[i].buf);
+			break;
+		}
+	}
+
+	cache->stagesCnt = i;
+	if (i < n) {
+		cache_freeStages(cache);
+		return err;
+	}
+
+	return EOK;
+}
+
+
+static int cache_allocMerge(cachectx_t *cache)
+{
+	int err;
+
+	cache->merge = malloc((size_t)1 << cache->sectorBits);
+	if (cache->merge == NULL) {
+		return -ENOMEM;
+	}
+
+	err = mutexCreate(&cache->mergeLock);
+	if (err < 0) {
+		free(cache->merge);
+		cache->merge = NULL;
+	}
+
+	return err;
+}
+
+
+static int cache_allocIo(cachectx_t *cache, size_t depth)
+{
+	int err;
+	size_t i;
+
+	if (cache->ops.readAsyncCb == NULL || cache->ops.writeAsyncCb == NULL) {
+		return EOK;
+	}
+
+	if (depth == 0 || depth > LIBCACHE_IO_DEPTH) {
+		depth = LIBCACHE_IO_DEPTH;
+	}
+
+	cache->ioPool = malloc(depth * sizeof(cacheio_t));
+	if (cache->ioPool == NULL) {
+		return -ENOMEM;
+	}
+
+	err = mutexCreate(&cache->ioLock);
+	if (err < 0) {
+		free(cache->ioPool);
+		cache->ioPool = NULL;
+		return err;
+	}
+
+	err = condCreate(&cache->ioCond);
+	if (err < 0) {
+		resourceDestroy(cache->ioLock);
+		free(cache->ioPool);
+		cache->ioPool = NULL;
+		return err;
+	}
+
+	for (i = 0; i < depth; ++i) {
+		cache->ioPool[i].cache = cache;
+		cache->ioPool[i].next = (i + 1 < depth) ? &cache->ioPool[i + 1] : NULL;
+	}
+	cache->ioFree = cache->ioPool;
+	cache->ioDepth = depth;
+
+	return EOK;
+}
+
+
+cachepool_t *cache_poolCreate(size_t lineSize, size_t linesCnt, size_t lineAlign)
+{
+	size_t i, stride;
+	uintptr_t base;
+	cachepool_t *pool;
+
+	if (lineAlign == 0) {
+		lineAlign = sizeof(void *);
+	}
+
+	if (lineSize == 0 || linesCnt == 0 || (lineAlign & (lineAlign - 1)) != 0) {
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(cachepool_t));
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	stride = (lineSize + lineAlign - 1) & ~(lineAlign - 1);
+
+	pool->arena = malloc(stride * linesCnt + lineAlign - 1);
+	pool->free = malloc(linesCnt * sizeof(void *));
+	if (pool->arena == NULL || pool->free == NULL) {
+		free(pool->free);
+		free(pool->arena);
+		free(pool);
+		return NULL;
+	}
+
+	if (mutexCreate(&pool->lock) < 0) {
+		free(pool->free);
+		free(pool->arena);
+		free(pool);
+		return NULL;
+	}
+
+	if (condCreate(&pool->cond) < 0) {
+		resourceDestroy(pool->lock);
+		free(pool->free);
+		free(pool->arena);
+		free(pool);
+		return NULL;
+	}
+
+	base = ((uintptr_t)pool->arena + lineAlign - 1) & ~(uintptr_t)(lineAlign - 1);
+
+	for (i = 0; i < linesCnt; ++i) {
+		pool->free[i] = (void *)(base + i * stride);
+	}
+	pool->freeCnt = linesCnt;
+	pool->linesCnt = linesCnt;
+	pool->lineSize = lineSize;
+
+	return pool;
+}
+
+
+int cache_poolDestroy(cachepool_t *pool)
+{
+	mutexLock(pool->lock);
+	if (pool->members != NULL) {
+		mutexUnlock(pool->lock);
+		return -EBUSY;
+	}
+	mutexUnlock(pool->lock);
+
+	resourceDestroy(pool->cond);
+	resourceDestroy(pool->lock);
+	free(pool->free);
+	free(pool->arena);
+	free(pool);
+
+	return EOK;
+}
+
+
+static int cache_poolAttach(cachectx_t *cache, const cache_opts_t *opts)
+{
+	cachepool_t *pool = opts->pool;
+	size_t max = (opts->poolMax != 0 && opts->poolMax < cache->linesCnt) ? opts->poolMax : cache->linesCnt;
+
+	if (pool->lineSize != cache->lineSize || opts->poolMin > max) {
+		return -EINVAL;
+	}
+
+	mutexLock(pool->lock);
+
+	/* Minimum quotas of all members have to fit in pool at once */
+	if (pool->minSum + opts->poolMin > pool->linesCnt) {
+		mutexUnlock(pool->lock);
+		return -ENOSPC;
+	}
+
+	pool->minSum += opts->poolMin;
+	cache->poolMin = opts->poolMin;
+	cache->poolMax = max;
+	cache->pool = pool;
+	LIST_ADD_EX(&pool->members, cache, poolNext, poolPrev);
+
+	mutexUnlock(pool->lock);
+
+	return EOK;
+}
+
+
+/* Stops other members of pool from reclaiming lines of cache, its buffers are still returned to pool */
+static void cache_poolLeave(cachectx_t *cache)
+{
+	cachepool_t *pool = cache->pool;
+
+	mutexLock(pool->lock);
+
+	if (cache->poolNext != NULL) {
+		LIST_REMOVE_EX(&pool->members, cache, poolNext, poolPrev);
+		pool->minSum -= cache->poolMin;
+	}
+
+	/* Other members may still write back lines of cache */
+	while (cache->poolRefs != 0) {
+		condWait(pool->cond, pool->lock, 0);
+	}
+
+	mutexUnlock(pool->lock);
+}
+
+
+/* Called once all lines of cache are invalidated */
+static void cache_poolDetach(cachectx_t *cache)
+{
+	cache_poolLeave(cache);
+	cache->pool = NULL;
+}
+
+
+/* Releases all context resources, lines have to be written back by caller */
+static void cache_destroy(cachectx_t *cache)
+{
+	if (cache->pool != NULL) {
+		cache_poolDetach(cache);
+	}
+
+	if (cache->ra != NULL) {
+		cache_raDeinit(cache);
+	}
+
+	if (cache->flusher != NULL) {
+		cache_flusherDeinit(cache);
+	}
+
+	if (cache->stages != NULL) {
+		cache_freeStages(cache);
+	}
+
+	if (cache->merge != NULL) {
+		resourceDestroy(cache->mergeLock);
+		free(cache->merge);
+	}
+
+	if (cache->ioPool != NULL) {
+		resourceDestroy(cache->ioCond);
+		resourceDestroy(cache->ioLock);
+		free(cache->ioPool);
+	}
+
+	if (cache->stripes != NULL) {
+		cache_destroyLocks(cache, cache->stripeMask + 1);
+	}
+
+	cache_freeSets(cache);
+	free(cache);
+}
+
+
+/* Set index is taken from address bits, so number of sets has to be a power of 2 */
+static int cache_checkGeometry(size_t linesCnt, size_t numWays)
+{
+	size_t numSets;
+
+	if (linesCnt == 0 || numWays == 0 || linesCnt % numWays != 0) {
+		return -EINVAL;
+	}
+
+	numSets = linesCnt / numWays;
+
+	return ((numSets & (numSets - 1)) == 0) ? EOK : -EINVAL;
+}
+
+
+/* Derives set geometry of linesCnt lines, numWays per set */
+static void cache_setGeometry(cachectx_t *cache, size_t linesCnt, size_t numWays)
+{
+	cache->linesCnt = linesCnt;
+	cache->numWays = numWays;
+	cache->numSets = linesCnt / numWays;
+	cache->fpWords = LIBCACHE_FP_WORDS(numWays);
+
+	cache->offBitsNum = LOG2(cache->lineSize);
+	cache->setBitsNum = LOG2(cache->numSets);
+	cache->tagBitsNum = LIBCACHE_ADDR_WIDTH - cache->setBitsNum - cache->offBitsNum;
+
+	cache->tagMask = cache_generateMask(cache->tagBitsNum);
+	cache->setMask = cache_generateMask(cache->setBitsNum);
+	cache->offMask = cache_generateMask(cache->offBitsNum);
+}
+
+
+cachectx_t *cache_initEx(size_t srcMemSize, size_t lineSize, size_t linesCnt, const cache_ops_t *ops, const cache_opts_t *opts)
+{
+	int err;
+	size_t numWays = LIBCACHE_WAYS_DEFAULT, stackSz = LIBCACHE_THREAD_STACK;
+	unsigned int prio = LIBCACHE_THREAD_PRIO;
+	cachectx_t *cache = NULL;
+
+	if (opts != NULL && opts->numWays != 0) {
+		numWays = (opts->numWays == LIBCACHE_WAYS_FULL) ? linesCnt : opts->numWays;
+	}
+
+	if (opts != NULL && opts->threadPrio != 0) {
+		prio = opts->threadPrio;
+	}
+
+	if (opts != NULL && opts->threadStack != 0) {
+		stackSz = opts->threadStack;
+	}
+
+	if (srcMemSize == 0 || lineSize == 0 || cache_checkGeometry(linesCnt, numWays) < 0) {
+		return NULL;
+	}
+
+	/* Merged runs are cut at program unit boundaries, smaller or unaligned units would leave no run at all */
+	if (opts != NULL && opts->progUnit != 0 && ((opts->progUnit & (opts->progUnit - 1)) != 0 || opts->progUnit < lineSize)) {
+		return NULL;
+	}
+
+	/* Sectors are addressed with offset bits, LOG2() of other sizes would track wrong ranges */
+	if (opts != NULL && opts->sectorSize != 0 && (opts->sectorSize & (opts->sectorSize - 1)) != 0) {
+		return NULL;
+	}
+
+	cache = calloc(1, sizeof(cachectx_t));
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	cache->srcMemSize = srcMemSize;
+	cache->lineSize = lineSize;
+	cache->fullAssoc = (opts != NULL && opts->numWays == LIBCACHE_WAYS_FULL) ? 1 : 0;
+	cache_setGeometry(cache, linesCnt, numWays);
+
+	cache->ops = *ops;
+	cache->fastHits = (opts != NULL && (opts->flags & LIBCACHE_OPT_FAST_HITS) != 0) ? 1 : 0;
+
+	err = cache_replInit(cache, (opts != NULL) ? opts->replPolicy : LIBCACHE_REPL_LRU);
+	if (err == EOK) {
+		err = cache_allocSets(cache);
+	}
+	/* Pool buffers are already preallocated */
+	if (err == EOK && opts != NULL && opts->pool == NULL && (opts->flags & LIBCACHE_OPT_PREALLOC) != 0) {
+		cache->lineAlign = opts->lineAlign;
+		err = cache_allocArena(cache, cache->lineAlign);
+	}
+
+	if (err == EOK) {
+		err = cache_createLocks(cache, (opts != NULL) ? opts->numLocks : 0);
+	}
+
+	if (err == EOK) {
+		err = cache_allocStage(cache, (opts != NULL) ? opts->ioLines : 0);
+	}
+
+	if (err == EOK) {
+		err = cache_allocIo(cache, (opts != NULL) ? opts->ioDepth : 0);
+	}
+
+	/* Single line is tracked with at most 64 sectors */
+	cache->sectorBits = cache->offBitsNum;
+	if (opts != NULL && opts->sectorSize != 0 && opts->sectorSize < cache->lineSize) {
+		cache->sectorBits = LOG2(opts->sectorSize);
+		if (cache->offBitsNum - cache->sectorBits > 6) {
+			cache->sectorBits = cache->offBitsNum - 6;
+		}
+	}
+	cache->sectorsMask = (cache->offBitsNum - cache->sectorBits == 6) ? ~(uint64_t)0 : ((uint64_t)1 << (cache->lineSize >> cache->sectorBits)) - 1;
+
+	if (err == EOK && cache->sectorBits < cache->offBitsNum) {
+		err = cache_allocMerge(cache);
+	}
+
+	if (opts != NULL) {
+		cache->progUnit = opts->progUnit;
+	}
+
+	/* Bypassed transfer has to span at least one whole line */
+	cache->bypassSize = SIZE_MAX;
+	if (opts != NULL && opts->bypassSize != 0) {
+		cache->bypassSize = (opts->bypassSize > 2 * lineSize) ? opts->bypassSize : 2 * lineSize;
+	}
+
+	if (err == EOK && opts != NULL && opts->raWindow != 0) {
+		err = cache_raInit(cache, opts->raWindow, prio, stackSz);
+	}
+
+	if (err == EOK && opts != NULL && (opts->dirtyHigh != 0 || opts->dirtyAge != 0)) {
+		err = cache_flusherInit(cache, opts, prio, stackSz);
+	}
+
+	/* Lines of cache may be reclaimed by other members as soon as it joins pool */
+	if (err == EOK && opts != NULL && opts->pool != NULL) {
+		err = cache_poolAttach(cache, opts);
+	}
+
+	if (err < 0) {
+		cache_destroy(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+
+cachectx_t *cache_init(size_t srcMemSize, size_t lineSize, size_t linesCnt, const cache_ops_t *ops)
+{
+	return cache_initEx(srcMemSize, lineSize, linesCnt, ops, NULL);
+}
+
+
+static uint64_t cache_computeAddr(const cachectx_t *cache, uint64_t tag, uint64_t setIndex)
+{
+	uint64_t temp = (tag << cache->setBitsNum) | setIndex;
+	return temp << cache->offBitsNum;
+}
+
+
+/* Returns index of set holding line */
+static uint64_t cache_lineSet(const cachectx_t *cache, const cacheline_t *linePtr)
+{
+	return (uint64_t)(linePtr - cache->lines) / cache->numWays;
+}
+
+
+/* Returns mask of sectors overlapping [offset, offset + count) of line */
+static uint64_t cache_sectorMask(const cachectx_t *cache, uint64_t offset, size_t count)
+{
+	uint64_t first = offset >> cache->sectorBits, last = (offset + count - 1) >> cache->sectorBits;
+
+	return (((uint64_t)2 << (last - first)) - 1) << first;
+}
+
+
+/* Returns mask of sector holding partial extent of line, 0 if there is none */
+static uint64_t cache_partMask(const cachectx_t *cache, const cacheline_t *linePtr)
+{
+	return (linePtr->partBeg != linePtr->partEnd) ? (uint64_t)1 << (linePtr->partBeg >> cache->sectorBits) : 0;
+}
+
+
+/*
+ * Decides how previous data of sectors partially overwritten by [offset, offset + count) is obtained.
+ * Write into invalid sector is kept as partial extent of line if possible, extent is updated only if
+ * requested. Returns mask of sectors which have to be fetched before write.
+ */
+static uint64_t cache_writeEdges(const cachectx_t *cache, cacheline_t *linePtr, uint64_t offset, size_t count, int update)
+{
+	uint64_t mask, fetch = 0, end = offset + count, sectorSize = (uint64_t)1 << cache->sectorBits;
+	uint64_t edge[2], beg, stop, partBeg = linePtr->partBeg, partEnd = linePtr->partEnd;
+	size_t i, n = 0;
+
+	/* Sector completely covered by write becomes valid, its partial extent is obsolete */
+	if (partBeg != partEnd && offset <= (partBeg & ~(sectorSize - 1)) && end >= (partBeg & ~(sectorSize - 1)) + sectorSize) {
+		partBeg = partEnd = 0;
+	}
+
+	if ((offset & (sectorSize - 1)) != 0) {
+		edge[n++] = offset & ~(sectorSize - 1);
+	}
+	if ((end & (sectorSize - 1)) != 0 && (n == 0 || (end & ~(sectorSize - 1)) != edge[0])) {
+		edge[n++] = end & ~(sectorSize - 1);
+	}
+
+	for (i = 0; i < n; ++i) {
+		mask = (uint64_t)1 << (edge[i] >> cache->sectorBits);
+		if ((linePtr->validMask & mask) != 0) {
+			continue;
+		}
+
+		beg = (offset > edge[i]) ? offset : edge[i];
+		stop = (end < edge[i] + sectorSize) ? end : edge[i] + sectorSize;
+
+		if (partBeg == partEnd) {
+			partBeg = beg;
+			partEnd = stop;
+		}
+		else if ((partBeg & ~(sectorSize - 1)) == edge[i] && beg <= partEnd && stop >= partBeg) {
+			/* Adjacent or overlapping writes (e.g. appends) grow the extent */
+			partBeg = (beg < partBeg) ? beg : partBeg;
+			partEnd = (stop > partEnd) ? stop : partEnd;
+		}
+		else {
+			fetch |= mask;
+			continue;
+		}
+
+		/* Extent grown to whole sector makes it valid */
+		if (partEnd - partBeg == sectorSize) {
+			partBeg = partEnd = 0;
+		}
+	}
+
+	if (update != 0) {
+		linePtr->partBeg = partBeg;
+		linePtr->partEnd = partEnd;
+	}
+
+	return fetch;
+}
+
+
+/* Marks sectors covering [offset, offset + count) of line as modified, written sectors except partial one become valid */
+static void cache_markDirty(cachectx_t *cache, cacheline_t *linePtr, uint64_t offset, size_t count)
+{
+	unsigned int dirtyCnt;
+	uint64_t mask = cache_sectorMask(cache, offset, count);
+	cacheflusher_t *fl = cache->flusher;
+
+	linePtr->validMask |= mask & ~cache_partMask(cache, linePtr);
+	linePtr->dirtyMask |= mask;
+
+	if (IS_DIRTY(linePtr->flags)) {
+		return;
+	}
+
+	SET_DIRTY(linePtr->flags);
+	LIST_ADD_EX(&cache->stripes[cache_lineSet(cache, linePtr) & cache->stripeMask].dirty, linePtr, dirtyNext, dirtyPrev);
+	dirtyCnt = atomic_fetch_add_explicit(&cache->dirtyCnt, 1, memory_order_relaxed) + 1;
+
+	if (fl != NULL) {
+		if (fl->age != 0) {
+			gettime(&linePtr->dirtyTime, NULL);
+		}
+
+		if (dirtyCnt == fl->high) {
+			mutexLock(fl->thr.lock);
+			condSignal(fl->thr.cond);
+			mutexUnlock(fl->thr.lock);
+		}
+	}
+}
+
+
+static void cache_markClean(cachectx_t *cache, cacheline_t *linePtr)
+{
+	linePtr->dirtyMask = 0;
+
+	if (IS_DIRTY(linePtr->flags)) {
+		CLEAR_DIRTY(linePtr->flags);
+		LIST_REMOVE_EX(&cache->stripes[cache_lineSet(cache, linePtr) & cache->stripeMask].dirty, linePtr, dirtyNext, dirtyPrev);
+		atomic_fetch_sub_explicit(&cache->dirtyCnt, 1, memory_order_relaxed);
+	}
+}
+
+
+static void cache_countTransfer(cachectx_t *cache, ssize_t count, int write)
+{
+	if (write != 0) {
+		atomic_fetch_add_explicit(&cache->counters.devWrites, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&cache->counters.bytesWritten, count, memory_order_relaxed);
+	}
+	else {
+		atomic_fetch_add_explicit(&cache->counters.devReads, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&cache->counters.bytesRead, count, memory_order_relaxed);
+	}
+}
+
+
+/* Skips transferred part of the vector */
+static void cache_skipIov(cache_iov_t **iov, size_t *iovcnt, size_t count)
+{
+	while (count > 0) {
+		if (count >= (*iov)->len) {
+			count -= (*iov)->len;
+			(*iov)++;
+			(*iovcnt)--;
+		}
+		else {
+			(*iov)->buf = (unsigned char *)(*iov)->buf + count;
+			(*iov)->len -= count;
+			count = 0;
+		}
+	}
+}
+
+
+/* Transfers contiguous device region from/to consecutive buffers, called without locks held */
+static int cache_devTransfer(cachectx_t *cache, uint64_t addr, cache_iov_t *iov, size_t iovcnt, int write)
+{
+	ssize_t count;
+
+	while (iovcnt > 0) {
+		if (iovcnt > 1) {
+			count = (write != 0) ? cache->ops.writevCb(addr, iov, iovcnt, cache->ops.ctx) : cache->ops.readvCb(addr, iov, iovcnt, cache->ops.ctx);
+		}
+		else {
+			count = (write != 0) ? cache->ops.writeCb(addr, iov->buf, iov->len, cache->ops.ctx) : cache->ops.readCb(addr, iov->buf, iov->len, cache->ops.ctx);
+		}
+
+		if (count <= 0) {
+			return -EIO;
+		}
+
+		cache_countTransfer(cache, count, write);
+
+		addr += count;
+		cache_skipIov(&iov, &iovcnt, count);
+	}
+
+	return EOK;
+}
+
+
+/*
+ * Completes sector holding partial extent of busy line with device data, called without locks held.
+ * Sector becomes valid, so the line owner may update its masks without set lock.
+ */
+static int cache_mergePart(cachectx_t *cache, cacheline_t *linePtr, uint64_t addr)
+{
+	int err;
+	size_t sectorSize = (size_t)1 << cache->sectorBits;
+	uint64_t sectorOff = linePtr->partBeg & ~(uint64_t)(sectorSize - 1);
+	unsigned char *merge = cache->merge;
+	cache_iov_t iov;
+
+	/* Whole line sector is merged rarely (tail of partially written line), its buffer is not kept */
+	if (merge == NULL) {
+		merge = malloc(sectorSize);
+		if (merge == NULL) {
+			return -ENOMEM;
+		}
+	}
+	else {
+		mutexLock(cache->mergeLock);
+	}
+
+	iov.buf = merge;
+	iov.len = sectorSize;
+	err = cache_devTransfer(cache, addr + sectorOff, &iov, 1, 0);
+	if (err == EOK) {
+		memcpy((unsigned char *)linePtr->data + sectorOff, merge, linePtr->partBeg - sectorOff);
+		memcpy((unsigned char *)linePtr->data + linePtr->partEnd, merge + (linePtr->partEnd - sectorOff), sectorOff + sectorSize - linePtr->partEnd);
+
+		linePtr->validMask |= cache_partMask(cache, linePtr);
+		linePtr->partBeg = 0;
+		linePtr->partEnd = 0;
+	}
+
+	if (merge != cache->merge) {
+		free(merge);
+	}
+	else {
+		mutexUnlock(cache->mergeLock);
+	}
+
+	return err;
+}
+
+
+/* Takes any free bounce buffer, waits for the one of address only if all of them are in use */
+static cachestage_t *cache_stageGet(cachectx_t *cache, uint64_t addr)
+{
+	size_t i, first = (addr >> cache->offBitsNum) % cache->stagesCnt;
+	cachestage_t *stage;
+
+	for (i = 0; i < cache->stagesCnt; ++i) {
+		stage = &cache->stages[(first + i) % cache->stagesCnt];
+		if (mutexTry(stage->lock) == EOK) {
+			return stage;
+		}
+	}
+
+	stage = &cache->stages[first];
+	mutexLock(stage->lock);
+
+	return stage;
+}
+
+
+static int cache_readSegment(cachectx_t *cache, uint64_t addr, cache_iov_t *iov, size_t iovcnt)
+{
+	int err;
+	size_t i, len = 0;
+	cache_iov_t stageIov;
+	cachestage_t *stage;
+
+	if (iovcnt > 1 && cache->ops.readvCb == NULL) {
+		stage = cache_stageGet(cache, addr);
+
+		for (i = 0; i < iovcnt; ++i) {
+			len += iov[i].len;
+		}
+
+		stageIov.buf = stage->buf;
+		stageIov.len = len;
+		err = cache_devTransfer(cache, addr, &stageIov, 1, 0);
+
+		for (i = 0, len = 0; err == EOK && i < iovcnt; ++i) {
+			memcpy(iov[i].buf, (unsigned char *)stage->buf + len, iov[i].len);
+			len += iov[i].len;
+		}
+
+		mutexUnlock(stage->lock);
+
+		return err;
+	}
+
+	return cache_devTransfer(cache, addr, iov, iovcnt, 0);
+}
+
+
+static int cache_writeSegment(cachectx_t *cache, uint64_t addr, cache_iov_t *iov, size_t iovcnt)
+{
+	int err;
+	size_t i, len = 0;
+	cache_iov_t stageIov;
+	cachestage_t *stage;
+
+	if (iovcnt > 1 && cache->ops.writevCb == NULL) {
+		stage = cache_stageGet(cache, addr);
+
+		for (i = 0; i < iovcnt; ++i) {
+			memcpy((unsigned char *)stage->buf + len, iov[i].buf, iov[i].len);
+			len += iov[i].len;
+		}
+
+		stageIov.buf = stage->buf;
+		stageIov.len = len;
+		err = cache_devTransfer(cache, addr, &stageIov, 1, 1);
+
+		mutexUnlock(stage->lock);
+
+		return err;
+	}
+
+	return cache_devTransfer(cache, addr, iov, iovcnt, 1);
+}
+
+
+static cacheio_t *cache_ioGet(cachectx_t *cache)
+{
+	cacheio_t *io;
+
+	mutexLock(cache->ioLock);
+	io = cache->ioFree;
+	if (io != NULL) {
+		cache->ioFree = io->next;
+	}
+	mutexUnlock(cache->ioLock);
+
+	return io;
+}
+
+
+static void cache_ioPut(cachectx_t *cache, cacheio_t *io)
+{
+	mutexLock(cache->ioLock);
+	io->next = cache->ioFree;
+	cache->ioFree = io;
+	mutexUnlock(cache->ioLock);
+}
+
+
+static void cache_ioDone(void *arg, ssize_t ret)
+{
+	cacheio_t *io = (cacheio_t *)arg;
+	cachectx_t *cache = io->cache;
+
+	mutexLock(cache->ioLock);
+	io->ret = ret;
+	io->done = 1;
+	condBroadcast(cache->ioCond);
+	mutexUnlock(cache->ioLock);
+}
+
+
+/* Starts transfer of prepared request, request not accepted by device is transferred synchronously by cache_ioWait() */
+static void cache_ioStart(cachectx_t *cache, cacheio_t *io)
+{
+	int err;
+
+	io->done = 0;
+	io->ret = 0;
+
+	if (io->write != 0) {
+		err = cache->ops.writeAsyncCb(io->addr, io->iov, io->iovcnt, cache_ioDone, io, cache->ops.ctx);
+	}
+	else {
+		err = cache->ops.readAsyncCb(io->addr, io->iov, io->iovcnt, cache_ioDone, io, cache->ops.ctx);
+	}
+
+	if (err < 0) {
+		io->done = 1;
+	}
+}
+
+
+/* Waits for request completion, part not transferred by device is transferred synchronously */
+static int cache_ioWait(cachectx_t *cache, cacheio_t *io)
+{
+	size_t iovcnt = io->iovcnt;
+	cache_iov_t *iov = io->iov;
+
+	mutexLock(cache->ioLock);
+	while (io->done == 0) {
+		condWait(cache->ioCond, cache->ioLock, 0);
+	}
+	mutexUnlock(cache->ioLock);
+
+	if (io->ret < 0) {
+		return -EIO;
+	}
+
+	if (io->ret > 0) {
+		cache_countTransfer(cache, io->ret, io->write);
+		cache_skipIov(&iov, &iovcnt, io->ret);
+	}
+
+	if (io->write != 0) {
+		return cache_writeSegment(cache, io->addr + io->ret, iov, iovcnt);
+	}
+
+	return cache_readSegment(cache, io->addr + io->ret, iov, iovcnt);
+}
+
+
+/*
+ * Prepares vector of next contiguous dirty region of run, starting search at sector pos counted from
+ * beginning of run. Returns number of vectors (one per line), 0 if there are no more dirty sectors.
+ */
+static size_t cache_nextSegment(const cachectx_t *cache, uint64_t addr, cacheline_t **run, size_t n, size_t *pos, cache_iov_t *iov, uint64_t *segAddr)
+{
+	size_t spl = cache->lineSize >> cache->sectorBits, total = n * spl;
+	size_t beg = *pos, end, i, iovcnt, lineBeg, lineEnd;
+
+	while (beg < total && !LIBCACHE_SECTOR_DIRTY(run, spl, beg)) {
+		beg++;
+	}
+
+	end = beg;
+	while (end < total && LIBCACHE_SECTOR_DIRTY(run, spl, end)) {
+		end++;
+	}
+
+	*pos = end;
+	if (beg == end) {
+		return 0;
+	}
+
+	/* Region may span several lines, each contributes single vector */
+	for (i = beg / spl, iovcnt = 0; i <= (end - 1) / spl; ++i, ++iovcnt) {
+		lineBeg = (i == beg / spl) ? (beg % spl) << cache->sectorBits : 0;
+		lineEnd = (i == (end - 1) / spl) ? ((end - 1) % spl + 1) << cache->sectorBits : cache->lineSize;
+
+		iov[iovcnt].buf = (unsigned char *)run[i]->data + lineBeg;
+		iov[iovcnt].len = lineEnd - lineBeg;
+	}
+
+	*segAddr = addr + ((uint64_t)beg << cache->sectorBits);
+
+	return iovcnt;
+}
+
+
+/* Writes back dirty sectors of consecutive lines, every contiguous dirty region with single device access */
+static int cache_writeRun(cachectx_t *cache, uint64_t addr, cacheline_t **run, size_t n)
+{
+	int err = EOK;
+	size_t i, iovcnt, pos = 0;
+	uint64_t segAddr;
+	cache_iov_t iov[LIBCACHE_IO_MAX];
+
+	/* Partially written sectors are completed first, device program is never narrower than sector */
+	for (i = 0; err == EOK && i < n; ++i) {
+		if (run[i]->partBeg != run[i]->partEnd) {
+			err = cache_mergePart(cache, run[i], addr + ((uint64_t)i << cache->offBitsNum));
+		}
+	}
+
+	while (err == EOK) {
+		iovcnt = cache_nextSegment(cache, addr, run, n, &pos, iov, &segAddr);
+		if (iovcnt == 0) {
+			break;
+		}
+
+		err = cache_writeSegment(cache, segAddr, iov, iovcnt);
+	}
+
+	return err;
+}
+
+
+/* Writes back dirty line, set lock is dropped for the time of device access */
+static int cache_flushLine(cachectx_t *cache, cachestripe_t *stripe, cacheline_t *linePtr, uint64_t addr)
+{
+	int err = EOK;
+
+	if ((linePtr != NULL) && IS_VALID(linePtr->flags) && IS_DIRTY(linePtr->flags)) {
+		cache_claimLine(linePtr);
+		mutexUnlock(stripe->lock);
+
+		err = cache_writeRun(cache, addr, &linePtr, 1);
+
+		cache_lockStripe(stripe);
+
+		if (err == EOK) {
+			cache_markClean(cache, linePtr);
+			stripe->stats.linesFlushed++;
+		}
+		cache_releaseLine(stripe, linePtr);
+	}
+
+	return err;
+}
+
+
+int cache_deinit(cachectx_t *cache)
+{
+	int err, ret = EOK;
+	cachestripe_t *stripe;
+
+	/* Helper threads and other members of pool must not touch lines while cache is being emptied */
+	if (cache->ra != NULL) {
+		cache_raDeinit(cache);
+	}
+
+	if (cache->flusher != NULL) {
+		cache_flusherDeinit(cache);
+	}
+
+	if (cache->pool != NULL) {
+		cache_poolLeave(cache);
+	}
+
+	/* Lines failing to be written back are dropped too, the first error is returned */
+	for (size_t i = 0; i < cache->numSets; ++i) {
+		stripe = cache_lockSet(cache, i);
+
+		for (size_t j = 0; j < cache->numWays; ++j) {
+			cacheline_t *linePtr = &(cache->sets[i].lines[j]);
+
+			if (!IS_VALID(linePtr->flags)) {
+				continue;
+			}
+
+			if (IS_DIRTY(linePtr->flags)) {
+				uint64_t addr = cache_computeAddr(cache, linePtr->tag, i);
+				err = cache_flushLine(cache, stripe, linePtr, addr);
+				if (err < 0 && ret == EOK) {
+					ret = err;
+				}
+			}
+
+			cache_invalidateLine(cache, &cache->sets[i], linePtr);
+		}
+
+		mutexUnlock(stripe->lock);
+	}
+
+	cache_destroy(cache);
+
+	return ret;
+}
+
+
+static int cache_executePolicy(cachectx_t *cache, cachestripe_t *stripe, cacheline_t *linePtr, uint64_t addr, int policy)
+{
+	if (policy == LIBCACHE_WRITE_THROUGH) {
+		return cache_flushLine(cache, stripe, linePtr, addr);
+	}
+
+	return 0;
+}
+
+
+static uint8_t cache_fingerprint(uint64_t tag)
+{
+	/* Fold tag into 7 bits, the highest bit keeps fingerprints of valid lines non-zero */
+	uint32_t fp = (uint32_t)tag ^ (uint32_t)(tag >> 32);
+
+	fp ^= fp >> 16;
+	fp ^= fp >> 8;
+
+	return (uint8_t)(fp | 0x80);
+}
+
+
+static void cache_setFingerprint(cacheset_t *setPtr, size_t way, uint8_t fp)
+{
+	cachefp_t *word = &setPtr->fps[way / LIBCACHE_FP_PER_WORD];
+	unsigned int shift = (way % LIBCACHE_FP_PER_WORD) * 8;
+
+	*word = (*word & ~((cachefp_t)0xff << shift)) | ((cachefp_t)fp << shift);
+}
+
+
+static cacheline_t *cache_findFreeLine(const cachectx_t *cache, cacheset_t *setPtr)
+{
+	size_t i;
+	cachefp_t zeros;
+
+	for (i = 0; i < cache->fpWords; ++i) {
+		zeros = LIBCACHE_FP_ZEROS(setPtr->fps[i]);
+		if (zeros != 0) {
+			return &setPtr->lines[i * LIBCACHE_FP_PER_WORD + (__builtin_ctzl(zeros) >> 3)];
+		}
+	}
+
+	return NULL;
+}
+
+
+/* Oldest line of list neither involved in device transfer nor pinned */
+static cacheline_t *cache_listVictim(cacheline_t *list)
+{
+	cacheline_t *linePtr = list;
+
+	if (list == NULL) {
+		return NULL;
+	}
+
+	do {
+		if (!IS_BUSY(linePtr->flags) && linePtr->pins == 0) {
+			return linePtr;
+		}
+		linePtr = linePtr->next;
+	} while (linePtr != list);
+
+	return NULL;
+}
+
+
+/* Lines of list, the last one (most recently added) first */
+static size_t cache_listOrder(cacheline_t *list, cacheline_t **lines)
+{
+	size_t n = 0;
+	cacheline_t *linePtr;
+
+	if (list == NULL) {
+		return 0;
+	}
+
+	linePtr = list->prev;
+	do {
+		lines[n++] = linePtr;
+		linePtr = linePtr->prev;
+	} while (linePtr != list->prev);
+
+	return n;
+}
+
+
+/* Moves line to the head of list, where victims are looked for first */
+static void cache_listDemote(cacheline_t **list, cacheline_t *linePtr)
+{
+	LIST_REMOVE(list, linePtr);
+	LIST_ADD(list, linePtr);
+	*list = linePtr;
+}
+
+
+static void cache_lruInsert(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	LIST_ADD(&setPtr->timestamps, linePtr);
+}
+
+
+static void cache_lruTouch(cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	LIST_REMOVE(&setPtr->timestamps, linePtr);
+	LIST_ADD(&setPtr->timestamps, linePtr);
+}
+
+
+static void cache_lruDemote(cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	cache_listDemote(&setPtr->timestamps, linePtr);
+}
+
+
+static cacheline_t *cache_lruVictim(const cachectx_t *cache, cacheset_t *setPtr)
+{
+	return cache_listVictim(setPtr->timestamps);
+}
+
+
+static void cache_lruRemove(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr, int evict)
+{
+	LIST_REMOVE(&setPtr->timestamps, linePtr);
+}
+
+
+static size_t cache_lruOrder(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t **lines)
+{
+	return cache_listOrder(setPtr->timestamps, lines);
+}
+
+
+/* CLOCK keeps no lists, hit costs a single flag update */
+static void cache_clockInsert(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr)
+{
+}
+
+
+static void cache_clockTouch(cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	SET_REFERENCED(linePtr->flags);
+}
+
+
+/* Hand is moved to line, so it is the next one inspected */
+static void cache_clockDemote(cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	CLEAR_REFERENCED(linePtr->flags);
+	setPtr->hand = linePtr - setPtr->lines;
+}
+
+
+static cacheline_t *cache_clockVictim(const cachectx_t *cache, cacheset_t *setPtr)
+{
+	size_t i;
+	cacheline_t *linePtr;
+
+	/* Referenced lines get second chance, so two sweeps find a victim unless all lines are busy or pinned */
+	for (i = 0; i < 2 * cache->numWays; ++i) {
+		linePtr = &setPtr->lines[setPtr->hand];
+		setPtr->hand = (setPtr->hand + 1 == cache->numWays) ? 0 : setPtr->hand + 1;
+
+		/* Set of pooled cache may have free ways */
+		if (IS_VALID(linePtr->flags) && !IS_BUSY(linePtr->flags) && linePtr->pins == 0) {
+			if (!IS_REFERENCED(linePtr->flags)) {
+				return linePtr;
+			}
+			CLEAR_REFERENCED(linePtr->flags);
+		}
+	}
+
+	return NULL;
+}
+
+
+static void cache_clockRemove(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr, int evict)
+{
+}
+
+
+/* Recency is known only as referenced bit, referenced lines go first */
+static size_t cache_clockOrder(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t **lines)
+{
+	size_t i, n = 0;
+	int pass;
+
+	for (pass = 1; pass >= 0; --pass) {
+		for (i = 0; i < cache->numWays; ++i) {
+			if (IS_VALID(setPtr->lines[i].flags) && IS_REFERENCED(setPtr->lines[i].flags) == pass) {
+				lines[n++] = &setPtr->lines[i];
+			}
+		}
+	}
+
+	return n;
+}
+
+
+/*
+ * 2Q: new lines wait in probation FIFO and are evicted from there first, so single scan
+ * cannot push out lines from main LRU list. Lines are admitted to main list when missed
+ * again shortly after being evicted from probation (their tags are kept as ghosts).
+ */
+static void cache_2qInsert(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	size_t i;
+
+	for (i = 0; i < cache->ghostsCnt; ++i) {
+		if (setPtr->ghosts[i] == linePtr->tag) {
+			setPtr->ghosts[i] = LIBCACHE_GHOST_NONE;
+			LIST_ADD(&setPtr->timestamps, linePtr);
+			return;
+		}
+	}
+
+	SET_PROBATION(linePtr->flags);
+	LIST_ADD(&setPtr->probation, linePtr);
+	setPtr->probCnt++;
+}
+
+
+static void cache_2qTouch(cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	/* Correlated accesses to line in probation do not prove it is hot */
+	if (!IS_PROBATION(linePtr->flags)) {
+		LIST_REMOVE(&setPtr->timestamps, linePtr);
+		LIST_ADD(&setPtr->timestamps, linePtr);
+	}
+}
+
+
+static void cache_2qDemote(cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	cache_listDemote(IS_PROBATION(linePtr->flags) ? &setPtr->probation : &setPtr->timestamps, linePtr);
+}
+
+
+static cacheline_t *cache_2qVictim(const cachectx_t *cache, cacheset_t *setPtr)
+{
+	cacheline_t *linePtr = NULL;
+
+	if (setPtr->probCnt > cache->probMax) {
+		linePtr = cache_listVictim(setPtr->probation);
+	}
+
+	if (linePtr == NULL) {
+		linePtr = cache_listVictim(setPtr->timestamps);
+	}
+
+	if (linePtr == NULL) {
+		linePtr = cache_listVictim(setPtr->probation);
+	}
+
+	return linePtr;
+}
+
+
+static void cache_2qRemove(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr, int evict)
+{
+	if (IS_PROBATION(linePtr->flags)) {
+		LIST_REMOVE(&setPtr->probation, linePtr);
+		setPtr->probCnt--;
+
+		if (evict != 0) {
+			setPtr->ghosts[setPtr->ghostHead] = linePtr->tag;
+			setPtr->ghostHead = (setPtr->ghostHead + 1 == cache->ghostsCnt) ? 0 : setPtr->ghostHead + 1;
+		}
+	}
+	else {
+		LIST_REMOVE(&setPtr->timestamps, linePtr);
+	}
+}
+
+
+/* Lines of main list were referenced at least twice, so they rank above ones in probation */
+static size_t cache_2qOrder(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t **lines)
+{
+	size_t n = cache_listOrder(setPtr->timestamps, lines);
+
+	return n + cache_listOrder(setPtr->probation, &lines[n]);
+}
+
+
+static const cachereplops_t cache_replOps[] = {
+	[LIBCACHE_REPL_LRU] = { cache_lruInsert, cache_lruTouch, cache_lruDemote, cache_lruVictim, cache_lruRemove, cache_lruOrder },
+	[LIBCACHE_REPL_CLOCK] = { cache_clockInsert, cache_clockTouch, cache_clockDemote, cache_clockVictim, cache_clockRemove, cache_clockOrder },
+	[LIBCACHE_REPL_2Q] = { cache_2qInsert, cache_2qTouch, cache_2qDemote, cache_2qVictim, cache_2qRemove, cache_2qOrder },
+};
+
+
+static int cache_replInit(cachectx_t *cache, unsigned int policy)
+{
+	if (policy >= sizeof(cache_replOps) / sizeof(cache_replOps[0])) {
+		return -EINVAL;
+	}
+
+	cache->repl = &cache_replOps[policy];
+
+	if (policy == LIBCACHE_REPL_2Q) {
+		/* Probation takes 1/4 and ghosts remember 1/2 of set as in original 2Q tuning */
+		cache->probMax = (cache->numWays >= 4) ? cache->numWays / 4 : 1;
+		cache->ghostsCnt = (cache->numWays >= 2) ? cache->numWays / 2 : 1;
+	}
+
+	return EOK;
+}
+
+
+static void cache_touchLine(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	cache->repl->touch(setPtr, linePtr);
+	if (cache->pool != NULL) {
+		linePtr->stamp = atomic_load_explicit(&cache->pool->clock, memory_order_relaxed);
+	}
+}
+
+
+/* Touches line if it had fast hit, recency of fast hits is applied only before it is needed */
+static void cache_applyHit(const cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	if (atomic_load_explicit(&linePtr->touched, memory_order_relaxed) != 0) {
+		atomic_store_explicit(&linePtr->touched, 0, memory_order_relaxed);
+		if (IS_VALID(linePtr->flags)) {
+			cache_touchLine(cache, setPtr, linePtr);
+		}
+	}
+}
+
+
+static void cache_applyHits(const cachectx_t *cache, cacheset_t *setPtr)
+{
+	size_t i;
+
+	if (cache->fastHits != 0) {
+		for (i = 0; i < cache->numWays; ++i) {
+			cache_applyHit(cache, setPtr, &setPtr->lines[i]);
+		}
+	}
+}
+
+
+/*
+ * Returns advice given for line at addr, LIBCACHE_ADVICE_NORMAL if there is none. Called with set lock held,
+ * so table is read without adviceLock and the lookup is repeated if advice changed meanwhile.
+ */
+static int cache_adviceAt(cachectx_t *cache, uint64_t addr)
+{
+	unsigned int i, n, seq;
+	int hint;
+
+	/* Lookup costs nothing until advice is given */
+	if (atomic_load_explicit(&cache->adviceCnt, memory_order_relaxed) == 0) {
+		return LIBCACHE_ADVICE_NORMAL;
+	}
+
+	do {
+		seq = atomic_load_explicit(&cache->adviceSeq, memory_order_acquire);
+		hint = LIBCACHE_ADVICE_NORMAL;
+
+		n = atomic_load_explicit(&cache->adviceCnt, memory_order_relaxed);
+		for (i = 0; (seq & 1) == 0 && i < n && i < LIBCACHE_ADVICE_MAX; ++i) {
+			if (addr >= cache->advice[i].beg && addr < cache->advice[i].end) {
+				hint = cache->advice[i].hint;
+				break;
+			}
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) != 0 || atomic_load_explicit(&cache->adviceSeq, memory_order_relaxed) != seq);
+
+	return hint;
+}
+
+
+static void cache_poolPut(cachectx_t *cache, void *buf)
+{
+	cachepool_t *pool = cache->pool;
+
+	mutexLock(pool->lock);
+	pool->free[pool->freeCnt++] = buf;
+	cache->poolUsed--;
+	condBroadcast(pool->cond);
+	mutexUnlock(pool->lock);
+}
+
+
+static void cache_poolRelease(cachestripe_t *stripe, const cachestripe_t *held)
+{
+	if (stripe != held) {
+		mutexUnlock(stripe->lock);
+	}
+}
+
+
+/*
+ * Finds least recently used idle line, clean or dirty one, among first LIBCACHE_POOL_SCAN resident lines of next
+ * stripe of every member which may give up lines (only of cache if own != 0), stripes without such line are skipped.
+ * Called with pool lock held, stripes other than held one are only tried, so scan never blocks. Stripe of found line
+ * is left locked.
+ */
+static void cache_poolScan(cachectx_t *cache, const cachestripe_t *held, int own, int dirty, cachepoolcand_t *cand)
+{
+	size_t i, n;
+	cachectx_t *donor = cache->pool->members;
+	cachestripe_t *stripe;
+	cacheline_t *linePtr;
+
+	cand->line = NULL;
+	cand->stripe = NULL;
+
+	do {
+		if (donor == cache || (own == 0 && donor->poolUsed > donor->poolMin)) {
+			/* Clean and dirty lines are looked for alternately, so each scan goes on until it finds any */
+			for (n = 0; n <= donor->stripeMask && (cand->line == NULL || cand->cache != donor); ++n) {
+				stripe = &donor->stripes[donor->poolStripe++ & donor->stripeMask];
+
+				if (stripe != held && mutexTry(stripe->lock) < 0) {
+					continue;
+				}
+
+				for (i = 0, linePtr = stripe->valid; linePtr != NULL && i < LIBCACHE_POOL_SCAN; ++i, linePtr = linePtr->validNext) {
+					if (i != 0 && linePtr == stripe->valid) {
+						break;
+					}
+
+					if (IS_BUSY(linePtr->flags) || linePtr->pins != 0 || IS_DIRTY(linePtr->flags) != dirty) {
+						continue;
+					}
+
+					if (donor->fastHits != 0) {
+						cache_applyHit(donor, &donor->sets[cache_lineSet(donor, linePtr)], linePtr);
+					}
+
+					if (cand->line == NULL || (int)(linePtr->stamp - cand->line->stamp) < 0) {
+						if (cand->stripe != NULL && cand->stripe != stripe) {
+							cache_poolRelease(cand->stripe, held);
+						}
+						cand->cache = donor;
+						cand->stripe = stripe;
+						cand->line = linePtr;
+					}
+				}
+
+				/* Resident list is rotated, so following scans see other lines */
+				if (linePtr != NULL) {
+					stripe->valid = linePtr;
+				}
+
+				if (cand->stripe != stripe) {
+					cache_poolRelease(stripe, held);
+				}
+			}
+		}
+
+		donor = donor->poolNext;
+	} while (donor != cache->pool->members);
+}
+
+
+/* Takes over buffer of least recently used clean line of pool, called with pool lock and set lock held */
+static int cache_poolReclaim(cachectx_t *cache, cachestripe_t *stripe, int own, void **buf)
+{
+	cachepoolcand_t cand;
+	cachectx_t *donor;
+
+	cache_poolScan(cache, stripe, own, 0, &cand);
+	if (cand.line == NULL) {
+		return -ENOSPC;
+	}
+
+	donor = cand.cache;
+	*buf = cand.line->data;
+	cand.line->data = NULL;
+	cand.stripe->stats.evictions++;
+	cache_invalidateLine(donor, &donor->sets[cache_lineSet(donor, cand.line)], cand.line);
+	cache_poolRelease(cand.stripe, stripe);
+
+	if (donor != cache) {
+		donor->poolUsed--;
+		cache->poolUsed++;
+		stripe->stats.poolReclaims++;
+	}
+
+	return EOK;
+}
+
+
+/* Returns -ENOSPC if there is no buffer to take and line of set has to be replaced instead */
+static int cache_poolGet(cachectx_t *cache, cachestripe_t *stripe, const cacheset_t *setPtr, void **buf)
+{
+	int err = -ENOSPC;
+	cachepool_t *pool = cache->pool;
+
+	mutexLock(pool->lock);
+
+	if (cache->poolUsed < cache->poolMax && pool->freeCnt != 0) {
+		*buf = pool->free[--pool->freeCnt];
+		cache->poolUsed++;
+		err = EOK;
+	}
+	else if (cache->poolUsed < cache->poolMax) {
+		err = cache_poolReclaim(cache, stripe, 0, buf);
+	}
+	else if (setPtr->count == 0) {
+		/* Cache at its quota with empty set gives up line of other set */
+		err = cache_poolReclaim(cache, stripe, 1, buf);
+	}
+
+	mutexUnlock(pool->lock);
+
+	return err;
+}
+
+
+/*
+ * Writes back least recently used dirty line of pool, so it can be reclaimed, or waits for buffer to be freed
+ * if there is none. Set lock is dropped meanwhile, so -EAGAIN is returned unless write-back fails.
+ */
+static int cache_poolWait(cachectx_t *cache, cachestripe_t *stripe)
+{
+	int ret, err = -EAGAIN;
+	uint64_t addr;
+	cachepool_t *pool = cache->pool;
+	cachepoolcand_t cand;
+
+	mutexUnlock(stripe->lock);
+	mutexLock(pool->lock);
+
+	cache_poolScan(cache, NULL, (cache->poolUsed >= cache->poolMax) ? 1 : 0, 1, &cand);
+	if (cand.line != NULL) {
+		addr = cache_computeAddr(cand.cache, cand.line->tag, cache_lineSet(cand.cache, cand.line));
+		mutexUnlock(cand.stripe->lock);
+
+		/* Member is not destroyed until write-back ends */
+		cand.cache->poolRefs++;
+		mutexUnlock(pool->lock);
+
+		/* Caller is already inside its own cache, other one being resized is left alone */
+		if (cand.cache == cache || cache_tryEnter(cand.cache) == EOK) {
+			/* Failed line stays dirty and would be picked again, so error is returned instead */
+			ret = cache_flushRange(cand.cache, addr, addr + cand.cache->lineSize, 0);
+			if (ret < 0) {
+				err = ret;
+			}
+			if (cand.cache != cache) {
+				cache_leave(cand.cache);
+			}
+		}
+
+		mutexLock(pool->lock);
+		cand.cache->poolRefs--;
+		condBroadcast(pool->cond);
+	}
+	else {
+		condWait(pool->cond, pool->lock, LIBCACHE_POOL_WAIT);
+	}
+
+	mutexUnlock(pool->lock);
+	cache_lockStripe(stripe);
+
+	return err;
+}
+
+
+/* Provides buffer of free way of set, -ENOSPC if pooled cache has to replace line of set instead */
+static int cache_lineBuffer(cachectx_t *cache, cachestripe_t *stripe, cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	int err;
+
+	if (linePtr->data != NULL) {
+		return EOK;
+	}
+
+	if (cache->pool == NULL) {
+		linePtr->data = malloc(cache->lineSize);
+		return (linePtr->data != NULL) ? EOK : -ENOMEM;
+	}
+
+	err = cache_poolGet(cache, stripe, setPtr, &linePtr->data);
+	if (err == -ENOSPC && setPtr->count == 0) {
+		err = cache_poolWait(cache, stripe);
+	}
+
+	return err;
+}
+
+
+/*
+ * Returns -EBUSY if all lines of set are busy (caller may wait for one of them),
+ * -EAGAIN if set lock had to be dropped and lookup has to be repeated
+ */
+static int cache_allocateLine(cachectx_t *cache, cachestripe_t *stripe, const uint64_t setIndex, const uint64_t tag, cacheline_t **line)
+{
+	int err;
+	uint64_t addr = 0;
+	cacheline_t *linePtr = NULL;
+	cacheset_t *setPtr = &cache->sets[setIndex];
+
+	if (setPtr->count < cache->numWays) {
+		/* Set is not full, so there must be a free way in set */
+		linePtr = cache_findFreeLine(cache, setPtr);
+
+		err = cache_lineBuffer(cache, stripe, setPtr, linePtr);
+		if (err == -ENOSPC) {
+			/* Pooled cache out of buffers replaces line of set as if set was full */
+			linePtr = NULL;
+		}
+		else if (err < 0) {
+			return err;
+		}
+		else {
+			setPtr->count++;
+			LIST_ADD_EX(&stripe->valid, linePtr, validNext, validPrev);
+			atomic_fetch_add_explicit(&cache->validCnt, 1, memory_order_relaxed);
+		}
+	}
+
+	if (linePtr == NULL) {
+		/* Set is full, take least recently used valid line from set */
+		cache_applyHits(cache, setPtr);
+		linePtr = cache->repl->victim(cache, setPtr);
+
+		if (linePtr == NULL) {
+			return -EBUSY;
+		}
+
+		if (IS_DIRTY(linePtr->flags)) {
+			stripe->stats.dirtyEvictions++;
+			addr = cache_computeAddr(cache, linePtr->tag, setIndex);
+			err = cache_flushLine(cache, stripe, linePtr, addr);
+			return (err < 0) ? err : -EAGAIN;
+		}
+
+		stripe->stats.evictions++;
+		cache->repl->remove(cache, setPtr, linePtr, 1);
+	}
+
+	cache_lineBegin(linePtr);
+	linePtr->tag = tag;
+	linePtr->validMask = 0;
+	linePtr->partBeg = 0;
+	linePtr->partEnd = 0;
+	unsigned char flags = 0;
+	SET_VALID(flags);
+	linePtr->flags = flags;
+	atomic_store_explicit(&linePtr->touched, 0, memory_order_relaxed);
+	if (cache->pool != NULL) {
+		linePtr->stamp = atomic_fetch_add_explicit(&cache->pool->clock, 1, memory_order_relaxed);
+	}
+	cache->repl->insert(cache, setPtr, linePtr);
+
+	if (cache_adviceAt(cache, cache_computeAddr(cache, tag, setIndex)) == LIBCACHE_ADVICE_NOREUSE) {
+		cache->repl->demote(setPtr, linePtr);
+	}
+
+	cache_setFingerprint(setPtr, linePtr - setPtr->lines, cache_fingerprint(tag));
+	cache_lineEnd(linePtr);
+
+	*line = linePtr;
+
+	return EOK;
+}
+
+
+static cacheline_t *cache_findLine(const cachectx_t *cache, cacheset_t *setPtr, uint64_t tag, int update)
+{
+	size_t i;
+	cachefp_t match, pattern = LIBCACHE_FP_LSB * cache_fingerprint(tag);
+	cacheline_t *linePtr;
+
+	for (i = 0; i < cache->fpWords; ++i) {
+		/* Candidate ways have a matching fingerprint, false positives are rejected by the full tag compare */
+		match = LIBCACHE_FP_ZEROS(setPtr->fps[i] ^ pattern);
+
+		while (match != 0) {
+			linePtr = &setPtr->lines[i * LIBCACHE_FP_PER_WORD + (__builtin_ctzl(match) >> 3)];
+
+			if (linePtr->tag == tag) {
+				if (update != LIBCACHE_TIMESTAMPS_NO_UPDATE) {
+					cache_touchLine(cache, setPtr, linePtr);
+				}
+
+				return linePtr;
+			}
+
+			match &= match - 1;
+		}
+	}
+
+	return NULL;
+}
+
+
+static uint64_t cache_computeOffset(const cachectx_t *cache, const uint64_t addr)
+{
+	return addr & cache->offMask;
+}
+
+
+static uint64_t cache_computeSetIndex(const cachectx_t *cache, const uint64_t addr)
+{
+	return (addr >> cache->offBitsNum) & cache->setMask;
+}
+
+
+static uint64_t cache_computeTag(const cachectx_t *cache, const uint64_t addr)
+{
+	return (addr >> (cache->offBitsNum + cache->setBitsNum)) & cache->tagMask;
+}
+
+
+static size_t cache_computeTempCount(const size_t left, const size_t lineSize, uint64_t *addr, uint64_t *offset, const size_t count, const size_t remainder)
+{
+	size_t tempCount = 0;
+
+	if (left == count) {
+		if (count <= (lineSize - *offset)) {
+			tempCount = count;
+		}
+		else {
+			tempCount = lineSize - *offset;
+		}
+		*addr -= *offset;
+	}
+	else {
+		*offset = 0;
+		tempCount = (left == remainder) ? remainder : lineSize;
+	}
+
+	return tempCount;
+}
+
+
+/* Reads invalid sectors of mask, every contiguous run with single device access */
+static int cache_fetchLine(cachectx_t *cache, cachestripe_t *stripe, const uint64_t setIndex, cacheline_t *linePtr, const uint64_t addr, uint64_t mask)
+{
+	int err = EOK;
+	size_t beg, end = 0, spl = cache->lineSize >> cache->sectorBits;
+	uint64_t part;
+	cache_iov_t iov;
+
+	mask &= ~linePtr->validMask;
+	part = mask & cache_partMask(cache, linePtr);
+
+	/* Concurrent lookups of the line wait until its data is valid */
+	cache_claimLine(linePtr);
+	mutexUnlock(stripe->lock);
+
+	/* Sector holding partial extent must not be overwritten by device data */
+	while (err == EOK && end < spl) {
+		beg = end;
+		while (beg < spl && (((mask & ~part) >> beg) & 1) == 0) {
+			beg++;
+		}
+
+		end = beg;
+		while (end < spl && (((mask & ~part) >> end) & 1) != 0) {
+			end++;
+		}
+
+		if (beg < end) {
+			iov.buf = (unsigned char *)linePtr->data + (beg << cache->sectorBits);
+			iov.len = (end - beg) << cache->sectorBits;
+			err = cache_devTransfer(cache, addr + (beg << cache->sectorBits), &iov, 1, 0);
+		}
+	}
+
+	if (err == EOK && part != 0) {
+		err = cache_mergePart(cache, linePtr, addr);
+	}
+
+	cache_lockStripe(stripe);
+
+	if (err == EOK) {
+		linePtr->validMask |= mask;
+	}
+	else if (linePtr->validMask == 0 && !IS_DIRTY(linePtr->flags)) {
+		cache_invalidateLine(cache, &cache->sets[setIndex], linePtr);
+	}
+	cache_releaseLine(stripe, linePtr);
+
+	return err;
+}
+
+
+/*
+ * Looks up line of addr, allocating it on miss. If any sector of need is invalid,
+ * invalid sectors of fetch are read from device.
+ */
+static int cache_getLine(cachectx_t *cache, cachestripe_t *stripe, const uint64_t addr, uint64_t need, uint64_t fetch, cacheline_t **line)
+{
+	int err;
+	uint64_t index = cache_computeSetIndex(cache, addr);
+	uint64_t tag = cache_computeTag(cache, addr);
+	cacheline_t *linePtr;
+
+	for (;;) {
+		linePtr = cache_findLine(cache, &cache->sets[index], tag, LIBCACHE_TIMESTAMPS_UPDATE);
+
+		/* cache hit */
+		if (linePtr != NULL) {
+			if (IS_BUSY(linePtr->flags)) {
+				cache_waitLine(stripe);
+				continue;
+			}
+
+			stripe->stats.hits++;
+			if (IS_PREFETCHED(linePtr->flags)) {
+				CLEAR_PREFETCHED(linePtr->flags);
+				stripe->stats.raHits++;
+			}
+			break;
+		}
+
+		/* cache miss */
+		err = cache_allocateLine(cache, stripe, index, tag, &linePtr);
+		if (err == -EBUSY) {
+			cache_waitLine(stripe);
+			continue;
+		}
+		if (err == -EAGAIN) {
+			continue;
+		}
+		if (err < 0) {
+			return err;
+		}
+
+		stripe->stats.misses++;
+		break;
+	}
+
+	if ((need & ~linePtr->validMask) != 0) {
+		err = cache_fetchLine(cache, stripe, index, linePtr, addr, fetch);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	*line = linePtr;
+
+	return EOK;
+}
+
+
+/* Reads consecutive busy lines with a single device access, called without locks held */
+static int cache_readRun(cachectx_t *cache, uint64_t addr, cacheline_t **run, size_t n)
+{
+	size_t i;
+	cache_iov_t iov[LIBCACHE_IO_MAX];
+
+	for (i = 0; i < n; ++i) {
+		iov[i].buf = run[i]->data;
+		iov[i].len = cache->lineSize;
+	}
+
+	return cache_readSegment(cache, addr, iov, n);
+}
+
+
+/* Claims up to maxLines consecutive lines missing in cache starting at addr, never waits. Returns number of claimed (busy) lines */
+static size_t cache_claimRun(cachectx_t *cache, uint64_t addr, size_t maxLines, cacheline_t **run, int prefetch)
+{
+	int err;
+	size_t i, n = 0;
+	uint64_t index, tag, lineAddr = addr;
+	cacheline_t *linePtr;
+	cachestripe_t *stripe;
+
+	for (i = 0; i < maxLines; ++i, lineAddr += cache->lineSize) {
+		index = cache_computeSetIndex(cache, lineAddr);
+		tag = cache_computeTag(cache, lineAddr);
+		stripe = cache_lockSet(cache, index);
+
+		/* Run ends on cached line (or line being fetched), its recency is left untouched */
+		if (cache_findLine(cache, &cache->sets[index], tag, LIBCACHE_TIMESTAMPS_NO_UPDATE) != NULL) {
+			mutexUnlock(stripe->lock);
+			break;
+		}
+
+		/* Never waits for busy lines while holding ones already claimed */
+		err = cache_allocateLine(cache, stripe, index, tag, &linePtr);
+		if (err < 0) {
+			mutexUnlock(stripe->lock);
+			break;
+		}
+
+		cache_claimLine(linePtr);
+		linePtr->validMask = cache->sectorsMask;
+		if (prefetch == LIBCACHE_FETCH_READAHEAD) {
+			SET_PREFETCHED(linePtr->flags);
+			stripe->stats.raLines++;
+		}
+		else if (prefetch == LIBCACHE_FETCH_WARM) {
+			stripe->stats.warmLines++;
+		}
+		else {
+			stripe->stats.misses++;
+		}
+		run[n++] = linePtr;
+
+		mutexUnlock(stripe->lock);
+	}
+
+	return n;
+}
+
+
+/* Completes read of claimed run, failed run is invalidated. On success lines stay busy if requested, until copied out */
+static void cache_finishRun(cachectx_t *cache, uint64_t addr, cacheline_t **run, size_t n, int err, int keep)
+{
+	size_t i;
+	uint64_t index, lineAddr = addr;
+	cachestripe_t *stripe;
+
+	for (i = 0; i < n; ++i, lineAddr += cache->lineSize) {
+		if (err == EOK && keep != 0) {
+			continue;
+		}
+
+		index = cache_computeSetIndex(cache, lineAddr);
+		stripe = cache_lockSet(cache, index);
+		if (err < 0) {
+			cache_invalidateLine(cache, &cache->sets[index], run[i]);
+		}
+		cache_releaseLine(stripe, run[i]);
+		mutexUnlock(stripe->lock);
+	}
+}
+
+
+/*
+ * Allocates up to maxLines consecutive lines missing from cache starting at addr and fetches them
+ * with a single device access. Returns number of fetched lines (0 if line at addr is cached or could
+ * not be allocated). Demand fetched lines are left busy and owned by the caller, prefetched lines are released.
+ */
+static int cache_fetchRun(cachectx_t *cache, uint64_t addr, size_t maxLines, cacheline_t **run, int prefetch)
+{
+	int err;
+	size_t n = cache_claimRun(cache, addr, maxLines, run, prefetch);
+
+	if (n == 0) {
+		return 0;
+	}
+
+	err = cache_readRun(cache, addr, run, n);
+	cache_finishRun(cache, addr, run, n, err, (prefetch == LIBCACHE_FETCH_DEMAND) ? 1 : 0);
+
+	return (err < 0) ? err : (int)n;
+}
+
+
+/*
+ * Starts asynchronous reads of up to lines consecutive lines missing in cache starting at addr,
+ * in as many requests as available. Returns number of requests in flight, io[] is in address order.
+ */
+static size_t cache_fetchStart(cachectx_t *cache, uint64_t addr, size_t lines, cacheio_t **io)
+{
+	size_t i, k, n;
+
+	for (k = 0; k < cache->ioDepth && lines > 0; ++k) {
+		io[k] = cache_ioGet(cache);
+		if (io[k] == NULL) {
+			break;
+		}
+
+		n = cache_claimRun(cache, addr, (lines < cache->ioLines) ? lines : cache->ioLines, io[k]->run, LIBCACHE_FETCH_DEMAND);
+		if (n == 0) {
+			cache_ioPut(cache, io[k]);
+			break;
+		}
+
+		for (i = 0; i < n; ++i) {
+			io[k]->iov[i].buf = io[k]->run[i]->data;
+			io[k]->iov[i].len = cache->lineSize;
+		}
+		io[k]->n = n;
+		io[k]->iovcnt = n;
+		io[k]->addr = addr;
+		io[k]->lineAddr = addr;
+		io[k]->write = 0;
+		cache_ioStart(cache, io[k]);
+
+		addr += (uint64_t)n << cache->offBitsNum;
+		lines -= n;
+	}
+
+	return k;
+}
+
+
+/* Prefetches missing lines numbered [line, end), cached lines are skipped. Returns first error */
+static int cache_prefetch(cachectx_t *cache, uint64_t line, uint64_t end)
+{
+	int fetched, err = EOK;
+	size_t n;
+	cacheline_t *run[LIBCACHE_IO_MAX];
+
+	while (line < end) {
+		n = (end - line < cache->ioLines) ? (end - line) : cache->ioLines;
+		fetched = cache_fetchRun(cache, line << cache->offBitsNum, n, run, LIBCACHE_FETCH_READAHEAD);
+		if (fetched < 0 && err == EOK) {
+			err = fetched;
+		}
+		line += (fetched > 0) ? fetched : 1;
+	}
+
+	return err;
+}
+
+
+static void cache_raThread(void *arg)
+{
+	cachectx_t *cache = (cachectx_t *)arg;
+	cachera_t *ra = cache->ra;
+	uint64_t line, end;
+
+	mutexLock(ra->thr.lock);
+
+	for (;;) {
+		while (ra->used == 0 && ra->thr.stop == 0) {
+			condWait(ra->thr.cond, ra->thr.lock, 0);
+		}
+
+		if (ra->thr.stop != 0) {
+			break;
+		}
+
+		line = ra->queue[ra->head].beg;
+		end = ra->queue[ra->head].end;
+		ra->head = (ra->head + 1) % LIBCACHE_RA_QUEUE;
+		ra->used--;
+
+		mutexUnlock(ra->thr.lock);
+
+		cache_enter(cache);
+		cache_prefetch(cache, line, end);
+		cache_leave(cache);
+
+		mutexLock(ra->thr.lock);
+	}
+
+	mutexUnlock(ra->thr.lock);
+
+	endthread();
+}
+
+
+/* Queues prefetch of lines numbered [beg, end) to read-ahead thread, returns 0 if queue is full */
+static int cache_raQueue(cachera_t *ra, uint64_t beg, uint64_t end)
+{
+	size_t i;
+
+	if (ra->used == LIBCACHE_RA_QUEUE) {
+		return 0;
+	}
+
+	i = (ra->head + ra->used) % LIBCACHE_RA_QUEUE;
+	ra->queue[i].beg = beg;
+	ra->queue[i].end = end;
+	ra->used++;
+	condSignal(ra->thr.cond);
+
+	return 1;
+}
+
+
+/* Tracks sequential streams of reads and requests prefetch of lines ahead of them */
+static void cache_raUpdate(cachectx_t *cache, const uint64_t addr, const size_t count)
+{
+	size_t i, window;
+	unsigned int trigger = LIBCACHE_RA_TRIGGER;
+	cachera_t *ra = cache->ra;
+	cachestream_t *stream = NULL, *victim = &ra->streams[0];
+	uint64_t beg = addr >> cache->offBitsNum;
+	uint64_t end = ((addr + count - 1) >> cache->offBitsNum) + 1;
+	uint64_t limit = ((uint64_t)cache->srcMemSize + cache->lineSize - 1) >> cache->offBitsNum;
+	uint64_t target;
+
+	window = ra->window;
+	switch (cache_adviceAt(cache, addr)) {
+		case LIBCACHE_ADVICE_RANDOM:
+			return;
+
+		/* Advised stream is prefetched from the first read with twice the window */
+		case LIBCACHE_ADVICE_SEQUENTIAL:
+			trigger = 1;
+			window *= 2;
+			break;
+
+		default:
+			break;
+	}
+
+	mutexLock(ra->thr.lock);
+
+	for (i = 0; i < LIBCACHE_RA_STREAMS; ++i) {
+		/* Read continues stream if it starts in the last line read or right after it */
+		if (ra->streams[i].run != 0 && beg + 1 >= ra->streams[i].next && beg <= ra->streams[i].next) {
+			stream = &ra->streams[i];
+			break;
+		}
+
+		if (ra->streams[i].stamp < victim->stamp) {
+			victim = &ra->streams[i];
+		}
+	}
+
+	if (stream == NULL) {
+		stream = victim;
+		stream->run = 0;
+		stream->issued = 0;
+	}
+
+	stream->stamp = ++ra->stamp;
+	stream->next = end;
+	stream->run++;
+
+	if (stream->run >= trigger) {
+		if (stream->issued < end) {
+			stream->issued = end;
+		}
+
+		target = (end + window < limit) ? (end + window) : limit;
+
+		/* Window is refilled once half of it has been consumed */
+		if (stream->issued < target && 2 * (target - stream->issued) >= window && cache_raQueue(ra, stream->issued, target) != 0) {
+			stream->issued = target;
+		}
+	}
+
+	mutexUnlock(ra->thr.lock);
+}
+
+
+/* Returns line holding addr once it is idle, NULL if not cached */
+static cacheline_t *cache_findIdleLine(cachectx_t *cache, cachestripe_t *stripe, const uint64_t addr)
+{
+	uint64_t index = cache_computeSetIndex(cache, addr);
+	uint64_t tag = cache_computeTag(cache, addr);
+	cacheline_t *linePtr;
+
+	for (;;) {
+		linePtr = cache_findLine(cache, &cache->sets[index], tag, LIBCACHE_TIMESTAMPS_NO_UPDATE);
+		if (linePtr == NULL || !IS_BUSY(linePtr->flags)) {
+			return linePtr;
+		}
+
+		cache_waitLine(stripe);
+	}
+}
+
+
+static ssize_t cache_writeLines(cachectx_t *cache, uint64_t addr, const void *buffer, size_t count, int policy)
+{
+	int err;
+	ssize_t position = 0;
+	uint64_t index = 0, offset = 0, fetch;
+	size_t tempCount = 0, left = 0, remainder = 0;
+	cacheline_t *linePtr = NULL;
+	cachestripe_t *stripe;
+
+	left = count;
+	offset = cache_computeOffset(cache, addr);
+	remainder = (left - (cache->lineSize - offset)) % cache->lineSize;
+
+	/* Write-backs of lines written through are kept in flight together */
+	if (policy == LIBCACHE_WRITE_THROUGH && cache->ioDepth > 0 && offset + count > cache->lineSize) {
+		position = cache_writeLines(cache, addr, buffer, count, LIBCACHE_WRITE_BACK);
+		if (position > 0) {
+			err = cache_flushRange(cache, addr, addr + count, 0);
+			if (err < 0) {
+				position = err;
+			}
+		}
+
+		return position;
+	}
+
+	while (left > 0) {
+		index = cache_computeSetIndex(cache, addr);
+
+		tempCount = cache_computeTempCount(left, cache->lineSize, &addr, &offset, count, remainder);
+
+		stripe = cache_lockSet(cache, index);
+
+		/* Line is allocated without fetch, only sectors partially overwritten may need their previous data */
+		err = cache_getLine(cache, stripe, addr, 0, 0, &linePtr);
+		if (err == EOK) {
+			fetch = cache_writeEdges(cache, linePtr, offset, tempCount, 0);
+			if (fetch != 0) {
+				err = cache_fetchLine(cache, stripe, index, linePtr, addr, fetch);
+			}
+		}
+		if (err < 0) {
+			mutexUnlock(stripe->lock);
+			position = err;
+			break;
+		}
+
+		cache_lineBegin(linePtr);
+		memcpy((unsigned char *)linePtr->data + offset, (const unsigned char *)buffer + position, tempCount);
+
+		cache_writeEdges(cache, linePtr, offset, tempCount, 1);
+
+		cache_markDirty(cache, linePtr, offset, tempCount);
+		cache_lineEnd(linePtr);
+
+		err = cache_executePolicy(cache, stripe, linePtr, addr, policy);
+		mutexUnlock(stripe->lock);
+		if (err < 0) {
+			position = err;
+			break;
+		}
+
+		position += tempCount;
+		left -= tempCount;
+		addr += cache->lineSize;
+	}
+
+	return position;
+}
+
+
+/*
+ * Copies count bytes at offset of line addr without set lock. Returns -EAGAIN if line is not resident,
+ * is busy, misses some of the sectors or changed during copy, the read has to go through set lock then.
+ *
+ * Fingerprints, tag, flags, validMask, data pointer and line data are read with plain loads racing with
+ * writers holding the set lock. The race is accepted as in any seqlock reader: nothing read is trusted
+ * unless line sequence, loaded with acquire before the checks, is even and unchanged when loaded again
+ * after acquire fence following the copy. Writers make it odd before changing any of these (release fence
+ * in cache_lineBegin()) and even after (release store in cache_lineEnd()). Stale data pointer is safe to
+ * copy from, as line buffers are not freed before deinit with fast hits. Data modified through cache_pin()
+ * is not covered by sequence.
+ */
+static int cache_readFast(cachectx_t *cache, uint64_t addr, uint64_t offset, void *buffer, size_t count)
+{
+	unsigned int seq;
+	uint64_t index = cache_computeSetIndex(cache, addr);
+	uint64_t tag = cache_computeTag(cache, addr);
+	cacheline_t *linePtr;
+	void *data;
+
+	linePtr = cache_findLine(cache, &cache->sets[index], tag, LIBCACHE_TIMESTAMPS_NO_UPDATE);
+	if (linePtr == NULL) {
+		return -EAGAIN;
+	}
+
+	/* Fields are read after sequence, line could have been replaced since lookup */
+	seq = atomic_load_explicit(&linePtr->seq, memory_order_acquire);
+	data = linePtr->data;
+	if ((seq & 1) != 0 || linePtr->tag != tag || !IS_VALID(linePtr->flags) || IS_BUSY(linePtr->flags) || data == NULL) {
+		return -EAGAIN;
+	}
+
+	/* Read-ahead hits are counted under set lock */
+	if (IS_PREFETCHED(linePtr->flags) || (cache_sectorMask(cache, offset, count) & ~linePtr->validMask) != 0) {
+		return -EAGAIN;
+	}
+
+	memcpy(buffer, (const unsigned char *)data + offset, count);
+
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&linePtr->seq, memory_order_relaxed) != seq) {
+		return -EAGAIN;
+	}
+
+	/* Recency is recorded approximately, as a reference applied under set lock before it is needed */
+	if (atomic_load_explicit(&linePtr->touched, memory_order_relaxed) == 0) {
+		atomic_store_explicit(&linePtr->touched, 1, memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&cache->stripes[index & cache->stripeMask].fastHits, 1, memory_order_relaxed);
+
+	return EOK;
+}
+
+
+static ssize_t cache_readLines(cachectx_t *cache, uint64_t addr, void *buffer, size_t count)
+{
+	int err;
+	ssize_t position = 0;
+	cacheline_t *linePtr = NULL, *run[LIBCACHE_IO_MAX], **runLines = run;
+	cacheio_t *io[LIBCACHE_IO_DEPTH];
+	cachestripe_t *stripe;
+	uint64_t index = 0, offset = 0;
+	size_t i, tempCount, left = count, remainder = 0, runPos = 0, runLen = 0, lines, ioPos = 0, ioCnt = 0;
+
+	left = count;
+	offset = cache_computeOffset(cache, addr);
+	remainder = (left - (cache->lineSize - offset)) % cache->lineSize;
+
+	while (left > 0) {
+		index = cache_computeSetIndex(cache, addr);
+
+		tempCount = cache_computeTempCount(left, cache->lineSize, &addr, &offset, count, remainder);
+
+		/* Resident line is copied without set lock, unless lines fetched for this read are pending */
+		if (cache->fastHits != 0 && runPos == runLen && ioPos == ioCnt && cache_readFast(cache, addr, offset, (unsigned char *)buffer + position, tempCount) == EOK) {
+			position += tempCount;
+			left -= tempCount;
+			addr += cache->lineSize;
+			continue;
+		}
+
+		/* Misses on consecutive lines are fetched with a single device access */
+		lines = (offset + left + cache->lineSize - 1) >> cache->offBitsNum;
+		if (runPos == runLen && ioPos == ioCnt && cache->ioDepth > 0 && lines > 1) {
+			/* With asynchronous callbacks several accesses are in flight, previous ones are consumed */
+			for (i = 0; i < ioCnt; ++i) {
+				cache_ioPut(cache, io[i]);
+			}
+			ioCnt = cache_fetchStart(cache, addr, lines, io);
+			ioPos = 0;
+		}
+
+		if (runPos == runLen && ioPos < ioCnt) {
+			err = cache_ioWait(cache, io[ioPos]);
+			cache_finishRun(cache, io[ioPos]->lineAddr, io[ioPos]->run, io[ioPos]->n, err, 1);
+			if (err < 0) {
+				/* Lines of reads still in flight are released */
+				for (i = ioPos + 1; i < ioCnt; ++i) {
+					cache_finishRun(cache, io[i]->lineAddr, io[i]->run, io[i]->n, cache_ioWait(cache, io[i]), 0);
+				}
+				position = err;
+				break;
+			}
+			runLines = io[ioPos]->run;
+			runPos = 0;
+			runLen = io[ioPos]->n;
+			ioPos++;
+		}
+		else if (runPos == runLen && cache->ioDepth == 0 && cache->ioLines > 1 && lines > 1) {
+			err = cache_fetchRun(cache, addr, (lines < cache->ioLines) ? lines : cache->ioLines, run, LIBCACHE_FETCH_DEMAND);
+			if (err < 0) {
+				position = err;
+				break;
+			}
+			runLines = run;
+			runPos = 0;
+			runLen = err;
+		}
+
+		stripe = cache_lockSet(cache, index);
+
+		if (runPos < runLen) {
+			/* Line fetched by coalesced read, busy until copied out */
+			linePtr = runLines[runPos++];
+		}
+		else {
+			err = cache_getLine(cache, stripe, addr, cache_sectorMask(cache, offset, tempCount), cache->sectorsMask, &linePtr);
+			if (err < 0) {
+				mutexUnlock(stripe->lock);
+				position = err;
+				break;
+			}
+		}
+
+		memcpy((unsigned char *)buffer + position, (const unsigned char *)linePtr->data + offset, tempCount);
+
+		if (IS_BUSY(linePtr->flags)) {
+			cache_releaseLine(stripe, linePtr);
+		}
+
+		mutexUnlock(stripe->lock);
+
+		position += tempCount;
+		left -= tempCount;
+		addr += cache->lineSize;
+	}
+
+	for (i = 0; i < ioCnt; ++i) {
+		cache_ioPut(cache, io[i]);
+	}
+
+	return position;
+}
+
+
+/* Returns number of lines starting at addr which may be written back with a single device access */
+static size_t cache_runLimit(const cachectx_t *cache, const uint64_t addr, const uint64_t end)
+{
+	size_t n = (end - addr + cache->lineSize - 1) >> cache->offBitsNum;
+
+	if (n > cache->ioLines) {
+		n = cache->ioLines;
+	}
+
+	if (cache->progUnit != 0 && n > ((cache->progUnit - (addr & (cache->progUnit - 1))) >> cache->offBitsNum)) {
+		n = (cache->progUnit - (addr & (cache->progUnit - 1))) >> cache->offBitsNum;
+	}
+
+	return n;
+}
+
+
+/*
+ * Claims up to maxLines consecutive dirty lines starting at addr for write-back. Busy line at addr is waited for
+ * if wait is set, otherwise -EBUSY is returned. Clean line at addr is invalidated if requested, 0 is returned then.
+ * Returns number of claimed lines.
+ */
+static int cache_claimDirty(cachectx_t *cache, uint64_t addr, size_t maxLines, cacheline_t **run, int invalidate, int wait)
+{
+	size_t n = 0;
+	uint64_t index, lineAddr = addr;
+	cacheline_t *linePtr;
+	cachestripe_t *stripe;
+
+	index = cache_computeSetIndex(cache, addr);
+	stripe = cache_lockSet(cache, index);
+
+	if (wait != 0) {
+		linePtr = cache_findIdleLine(cache, stripe, addr);
+	}
+	else {
+		linePtr = cache_findLine(cache, &cache->sets[index], cache_computeTag(cache, addr), LIBCACHE_TIMESTAMPS_NO_UPDATE);
+		if (linePtr != NULL && IS_BUSY(linePtr->flags)) {
+			mutexUnlock(stripe->lock);
+			return -EBUSY;
+		}
+	}
+
+	if (linePtr == NULL || !IS_DIRTY(linePtr->flags)) {
+		if (linePtr != NULL && invalidate != 0 && linePtr->pins == 0) {
+			cache_invalidateLine(cache, &cache->sets[index], linePtr);
+		}
+		mutexUnlock(stripe->lock);
+		return 0;
+	}
+
+	for (;;) {
+		cache_claimLine(linePtr);
+		run[n++] = linePtr;
+		mutexUnlock(stripe->lock);
+
+		lineAddr += cache->lineSize;
+		if (n == maxLines) {
+			break;
+		}
+
+		/* Never waits for busy lines while holding ones already claimed */
+		index = cache_computeSetIndex(cache, lineAddr);
+		stripe = cache_lockSet(cache, index);
+
+		linePtr = cache_findLine(cache, &cache->sets[index], cache_computeTag(cache, lineAddr), LIBCACHE_TIMESTAMPS_NO_UPDATE);
+		if (linePtr == NULL || IS_BUSY(linePtr->flags) || !IS_DIRTY(linePtr->flags)) {
+			mutexUnlock(stripe->lock);
+			break;
+		}
+	}
+
+	return (int)n;
+}
+
+
+/* Completes write-back of claimed run, lines stay dirty if it failed */
+static void cache_finishFlush(cachectx_t *cache, uint64_t addr, cacheline_t **run, size_t n, int err, int invalidate)
+{
+	size_t i;
+	uint64_t index, lineAddr = addr;
+	cachestripe_t *stripe;
+
+	for (i = 0; i < n; ++i, lineAddr += cache->lineSize) {
+		index = cache_computeSetIndex(cache, lineAddr);
+		stripe = cache_lockSet(cache, index);
+		if (err == EOK) {
+			cache_markClean(cache, run[i]);
+			stripe->stats.linesFlushed++;
+			if (invalidate != 0 && run[i]->pins == 0) {
+				cache_invalidateLine(cache, &cache->sets[index], run[i]);
+			}
+		}
+		cache_releaseLine(stripe, run[i]);
+		mutexUnlock(stripe->lock);
+	}
+}
+
+
+/*
+ * Writes back up to maxLines consecutive dirty lines starting at addr with a single device access,
+ * invalidating them afterwards if requested. Returns number of written back lines, 0 if line at addr
+ * is no longer dirty.
+ */
+static int cache_flushRun(cachectx_t *cache, uint64_t addr, size_t maxLines, int invalidate)
+{
+	int err;
+	size_t n;
+	cacheline_t *run[LIBCACHE_IO_MAX];
+
+	err = cache_claimDirty(cache, addr, maxLines, run, invalidate, 1);
+	if (err <= 0) {
+		return err;
+	}
+	n = (size_t)err;
+
+	err = cache_writeRun(cache, addr, run, n);
+	cache_finishFlush(cache, addr, run, n, err, invalidate);
+
+	return (err < 0) ? err : (int)n;
+}
+
+
+/* Waits for all write-backs of queue. Returns first error of write-backs completed since queue was set up */
+static int cache_flushDrain(cachectx_t *cache, cacheflushq_t *q)
+{
+	int err;
+	size_t i;
+
+	for (i = 0; i < q->cnt; ++i) {
+		err = cache_ioWait(cache, q->io[i]);
+		cache_finishFlush(cache, q->io[i]->lineAddr, q->io[i]->run, q->io[i]->n, err, q->invalidate);
+		if (err < 0 && q->err == EOK) {
+			q->err = err;
+		}
+		cache_ioPut(cache, q->io[i]);
+	}
+	q->cnt = 0;
+
+	return q->err;
+}
+
+
+/*
+ * As cache_flushRun(), but with asynchronous callbacks write-back is queued and left in flight. Runs needing
+ * several device accesses or a merge of partially written sectors are written back synchronously.
+ */
+static int cache_flushStart(cachectx_t *cache, cacheflushq_t *q, uint64_t addr, size_t maxLines)
+{
+	int err;
+	size_t i, n, pos = 0;
+	uint64_t segAddr;
+	cacheio_t *io = NULL;
+	cacheline_t *run[LIBCACHE_IO_MAX];
+	cache_iov_t iov[LIBCACHE_IO_MAX];
+
+	err = cache_claimDirty(cache, addr, maxLines, run, q->invalidate, 0);
+	if (err == -EBUSY) {
+		/* Lines held by queued write-backs are released before waiting for other ones */
+		cache_flushDrain(cache, q);
+		err = cache_claimDirty(cache, addr, maxLines, run, q->invalidate, 1);
+	}
+	if (err <= 0) {
+		return 1;
+	}
+	n = (size_t)err;
+
+	for (i = 0; i < n && run[i]->partBeg == run[i]->partEnd; ++i) {
+	}
+
+	if (cache->ioDepth > 0 && i == n) {
+		io = cache_ioGet(cache);
+		if (io == NULL && q->cnt > 0) {
+			cache_flushDrain(cache, q);
+			io = cache_ioGet(cache);
+		}
+	}
+
+	if (io != NULL) {
+		io->iovcnt = cache_nextSegment(cache, addr, run, n, &pos, io->iov, &io->addr);
+		if (cache_nextSegment(cache, addr, run, n, &pos, iov, &segAddr) == 0) {
+			memcpy(io->run, run, n * sizeof(run[0]));
+			io->n = n;
+			io->lineAddr = addr;
+			io->write = 1;
+			cache_ioStart(cache, io);
+			q->io[q->cnt++] = io;
+
+			return (int)n;
+		}
+
+		cache_ioPut(cache, io);
+	}
+
+	err = cache_writeRun(cache, addr, run, n);
+	cache_finishFlush(cache, addr, run, n, err, q->invalidate);
+
+	return (err < 0) ? err : (int)n;
+}
+
+
+/* Returns number of lines written back, lines failing to be written back are left for the next pass */
+static size_t cache_flusherPass(cachectx_t *cache, cacheflusher_t *fl)
+{
+	size_t i, done = 0;
+	int err, drain;
+	time_t now;
+	uint64_t addr = 0;
+	cacheline_t *linePtr;
+	cachestripe_t *stripe;
+
+	gettime(&now, NULL);
+
+	fl->err = EOK;
+	drain = (atomic_load_explicit(&cache->dirtyCnt, memory_order_relaxed) >= fl->high) ? 1 : 0;
+
+	for (i = 0; i <= cache->stripeMask; ++i) {
+		stripe = &cache->stripes[i];
+
+		for (;;) {
+			if (drain != 0 && atomic_load_explicit(&cache->dirtyCnt, memory_order_relaxed) <= fl->low) {
+				drain = 0;
+			}
+
+			if (drain == 0 && fl->age == 0) {
+				return done;
+			}
+
+			cache_lockStripe(stripe);
+
+			/* Lines are listed oldest first, lines being written back are skipped */
+			linePtr = stripe->dirty;
+			while (linePtr != NULL && IS_BUSY(linePtr->flags)) {
+				linePtr = (linePtr->dirtyNext != stripe->dirty) ? linePtr->dirtyNext : NULL;
+			}
+			if (linePtr != NULL && drain == 0 && now - linePtr->dirtyTime < fl->age) {
+				linePtr = NULL;
+			}
+			if (linePtr != NULL) {
+				addr = cache_computeAddr(cache, linePtr->tag, cache_lineSet(cache, linePtr));
+			}
+
+			mutexUnlock(stripe->lock);
+
+			if (linePtr == NULL) {
+				break;
+			}
+
+			/* Consecutive dirty lines are written back together */
+			err = cache_flushRun(cache, addr, cache_runLimit(cache, addr, cache->srcMemSize), 0);
+			if (err < 0) {
+				fl->err = err;
+				break;
+			}
+			done += (size_t)err;
+		}
+	}
+
+	return done;
+}
+
+
+static void cache_flusherThread(void *arg)
+{
+	cachectx_t *cache = (cachectx_t *)arg;
+	cacheflusher_t *fl = cache->flusher;
+	size_t done = 1;
+
+	mutexLock(fl->thr.lock);
+
+	while (fl->thr.stop == 0) {
+		/*
+		 * Dirty lines are checked twice per max age, unless high watermark is hit earlier. Over high watermark
+		 * pass which wrote nothing back (all dirty lines busy) or failed is not repeated before back-off.
+		 */
+		if (atomic_load_explicit(&cache->dirtyCnt, memory_order_relaxed) < fl->high) {
+			condWait(fl->thr.cond, fl->thr.lock, fl->age / 2);
+		}
+		else if (done == 0 || fl->err < 0) {
+			condWait(fl->thr.cond, fl->thr.lock, (fl->age / 2 != 0) ? fl->age / 2 : LIBCACHE_FLUSH_BACKOFF);
+		}
+
+		if (fl->thr.stop != 0) {
+			break;
+		}
+
+		mutexUnlock(fl->thr.lock);
+		cache_enter(cache);
+		done = cache_flusherPass(cache, fl);
+		cache_leave(cache);
+		mutexLock(fl->thr.lock);
+	}
+
+	mutexUnlock(fl->thr.lock);
+
+	endthread();
+}
+
+
+/*
+ * Tells if lines of [addr, end) are found faster on resident (or dirty only) lists of stripes
+ * than by lookup at every line of range. Lists are walked once per LIBCACHE_SCAN_BATCH lines found.
+ */
+static int cache_scanLists(cachectx_t *cache, uint64_t addr, uint64_t end, int dirty)
+{
+	uint64_t lines = (end - addr + cache->lineSize - 1) >> cache->offBitsNum;
+	uint64_t listed = atomic_load_explicit((dirty != 0) ? &cache->dirtyCnt : &cache->validCnt, memory_order_relaxed);
+
+	return (lines > listed * (listed / LIBCACHE_SCAN_BATCH + 1)) ? 1 : 0;
+}
+
+
+/*
+ * Collects addresses of up to LIBCACHE_SCAN_BATCH lowest resident (or dirty only) lines of [addr, end)
+ * in ascending order. Returns number of collected addresses.
+ */
+static size_t cache_collectLines(cachectx_t *cache, uint64_t addr, uint64_t end, int dirty, uint64_t *batch)
+{
+	size_t i, j, n = 0;
+	uint64_t lineAddr;
+	cacheline_t *head, *linePtr;
+	cachestripe_t *stripe;
+
+	for (i = 0; i <= cache->stripeMask; ++i) {
+		stripe = &cache->stripes[i];
+		cache_lockStripe(stripe);
+
+		head = (dirty != 0) ? stripe->dirty : stripe->valid;
+		linePtr = head;
+
+		while (linePtr != NULL) {
+			lineAddr = cache_computeAddr(cache, linePtr->tag, cache_lineSet(cache, linePtr));
+
+			/* Full batch drops its highest address */
+			if (lineAddr >= addr && lineAddr < end && (n < LIBCACHE_SCAN_BATCH || lineAddr < batch[n - 1])) {
+				if (n < LIBCACHE_SCAN_BATCH) {
+					n++;
+				}
+
+				for (j = n - 1; j > 0 && batch[j - 1] > lineAddr; --j) {
+					batch[j] = batch[j - 1];
+				}
+				batch[j] = lineAddr;
+			}
+
+			linePtr = (dirty != 0) ? linePtr->dirtyNext : linePtr->validNext;
+			if (linePtr == head) {
+				break;
+			}
+		}
+
+		mutexUnlock(stripe->lock);
+	}
+
+	return n;
+}
+
+
+static int cache_flushRange(cachectx_t *cache, uint64_t addr, const uint64_t end, int invalidate)
+{
+	int ret = EOK;
+	size_t i, n = LIBCACHE_SCAN_BATCH;
+	uint64_t batch[LIBCACHE_SCAN_BATCH];
+	cacheflushq_t q;
+
+	q.cnt = 0;
+	q.invalidate = invalidate;
+	q.err = EOK;
+
+	addr -= cache_computeOffset(cache, addr);
+
+	/* Lines are visited in address order, so adjacent dirty lines are merged into single writes */
+	if (cache_scanLists(cache, addr, end, invalidate == 0) == 0) {
+		while (addr < end) {
+			ret = cache_flushStart(cache, &q, addr, cache_runLimit(cache, addr, end));
+			if (ret < 0) {
+				break;
+			}
+
+			addr += (uint64_t)ret << cache->offBitsNum;
+			ret = EOK;
+		}
+	}
+	else {
+		/* Only listed lines are visited, still in address order. Lines invalidated on clean include clean ones */
+		while (ret == EOK && n == LIBCACHE_SCAN_BATCH) {
+			n = cache_collectLines(cache, addr, end, invalidate == 0, batch);
+
+			for (i = 0; i < n; ++i) {
+				/* Line may have been written back as a part of previous run */
+				if (batch[i] < addr) {
+					continue;
+				}
+
+				ret = cache_flushStart(cache, &q, batch[i], cache_runLimit(cache, batch[i], end));
+				if (ret < 0) {
+					break;
+				}
+
+				addr = batch[i] + ((uint64_t)ret << cache->offBitsNum);
+				ret = EOK;
+			}
+		}
+	}
+
+	/* Queued write-backs are completed on error too */
+	if (cache_flushDrain(cache, &q) < 0 && ret == EOK) {
+		ret = q.err;
+	}
+
+	return ret;
+}
+
+
+int cache_flush(cachectx_t *cache, const uint64_t begAddr, const uint64_t endAddr)
+{
+	int err;
+	uint64_t end = endAddr;
+
+	if (begAddr > endAddr || begAddr > cache->srcMemSize) {
+		return -EINVAL;
+	}
+
+	if (begAddr < cache->srcMemSize && endAddr > cache->srcMemSize) {
+		end = cache->srcMemSize;
+	}
+
+	atomic_fetch_add_explicit(&cache->counters.flushes, 1, memory_order_relaxed);
+
+	cache_enter(cache);
+	err = cache_flushRange(cache, begAddr, end, 0);
+	cache_leave(cache);
+
+	return err;
+}
+
+
+static void cache_invalidateLine(cachectx_t *cache, cacheset_t *setPtr, cacheline_t *linePtr)
+{
+	cache_lineBegin(linePtr);
+	cache->repl->remove(cache, setPtr, linePtr, 0);
+
+	/* Dirty data is dropped */
+	cache_markClean(cache, linePtr);
+
+	CLEAR_VALID(linePtr->flags);
+	LIST_REMOVE_EX(&cache->stripes[(uint64_t)(setPtr - cache->sets) & cache->stripeMask].valid, linePtr, validNext, validPrev);
+	atomic_fetch_sub_explicit(&cache->validCnt, 1, memory_order_relaxed);
+	cache_setFingerprint(setPtr, linePtr - setPtr->lines, 0);
+
+	/* Private buffer is kept by the way if fast hit may still copy from it, pool buffers stay allocated anyway */
+	if (cache->pool != NULL) {
+		/* Buffer reclaimed by other line is already detached */
+		if (linePtr->data != NULL) {
+			cache_poolPut(cache, linePtr->data);
+			linePtr->data = NULL;
+		}
+	}
+	else if (cache->arena == NULL && cache->fastHits == 0) {
+		free(linePtr->data);
+		linePtr->data = NULL;
+	}
+	linePtr->tag = 0;
+	cache_lineEnd(linePtr);
+
+	setPtr->count -= 1;
+}
+
+
+/* Updates resident lines (or dirty ones only) of line aligned range with caller data */
+static void cache_bypassSync(cachectx_t *cache, uint64_t addr, const unsigned char *buffer, size_t count, int dirtyOnly)
+{
+	uint64_t end = addr + count;
+	cacheline_t *linePtr;
+	cachestripe_t *stripe;
+
+	for (; addr < end; addr += cache->lineSize, buffer += cache->lineSize) {
+		stripe = cache_lockSet(cache, cache_computeSetIndex(cache, addr));
+
+		linePtr = cache_findIdleLine(cache, stripe, addr);
+		if (linePtr != NULL && (dirtyOnly == 0 || IS_DIRTY(linePtr->flags))) {
+			cache_lineBegin(linePtr);
+			memcpy(linePtr->data, buffer, cache->lineSize);
+
+			/* Partially written sector now holds caller data as a whole, merge could bring stale data back */
+			linePtr->validMask |= cache_partMask(cache, linePtr);
+			linePtr->partBeg = 0;
+			linePtr->partEnd = 0;
+			cache_lineEnd(linePtr);
+		}
+
+		mutexUnlock(stripe->lock);
+	}
+}
+
+
+/* Copies valid data of line over caller buffer, cached data is never older than device. Called with set lock held. */
+static void cache_bypassOverlay(cachectx_t *cache, const cacheline_t *linePtr, unsigned char *buffer)
+{
+	size_t i, sectorSize = (size_t)1 << cache->sectorBits;
+
+	for (i = 0; i < cache->lineSize; i += sectorSize) {
+		if (((cache_partMask(cache, linePtr) >> (i >> cache->sectorBits)) & 1) != 0) {
+			memcpy(buffer + linePtr->partBeg, (unsigned char *)linePtr->data + linePtr->partBeg, linePtr->partEnd - linePtr->partBeg);
+		}
+		else if (((linePtr->validMask >> (i >> cache->sectorBits)) & 1) != 0) {
+			memcpy(buffer + i, (unsigned char *)linePtr->data + i, sectorSize);
+		}
+	}
+}
+
+
+/*
+ * Reads line aligned range from device, overlaying data of lines dirty before device read. Such line may be
+ * written back and evicted meanwhile, with write-back landing after device read, it is read from device again
+ * then. Partially valid line is kept busy while the rest of it is read again, so it cannot go away before overlay.
+ */
+static int cache_bypassRead(cachectx_t *cache, uint64_t addr, unsigned char *buffer, size_t count)
+{
+	int err;
+	size_t i, n, pos, len;
+	uint64_t dirty, lineAddr;
+	cacheline_t *linePtr;
+	cachestripe_t *stripe;
+	cache_iov_t iov;
+
+	for (pos = 0; pos < count; pos += len) {
+		len = count - pos;
+		if (len > ((size_t)LIBCACHE_BYPASS_LINES << cache->offBitsNum)) {
+			len = (size_t)LIBCACHE_BYPASS_LINES << cache->offBitsNum;
+		}
+		n = len >> cache->offBitsNum;
+
+		/* Write-backs in flight are waited out */
+		for (i = 0, dirty = 0; i < n; ++i) {
+			lineAddr = addr + pos + (i << cache->offBitsNum);
+			stripe = cache_lockSet(cache, cache_computeSetIndex(cache, lineAddr));
+			linePtr = cache_findIdleLine(cache, stripe, lineAddr);
+			if (linePtr != NULL && IS_DIRTY(linePtr->flags)) {
+				dirty |= (uint64_t)1 << i;
+			}
+			mutexUnlock(stripe->lock);
+		}
+
+		iov.buf = buffer + pos;
+		iov.len = len;
+		err = cache_devTransfer(cache, addr + pos, &iov, 1, 0);
+		if (err < 0) {
+			return err;
+		}
+
+		/* Lines dirtied during device read are concurrent with it, either data will do */
+		for (i = 0; i < n; ++i) {
+			if (((dirty >> i) & 1) == 0) {
+				continue;
+			}
+
+			lineAddr = addr + pos + (i << cache->offBitsNum);
+			iov.buf = buffer + pos + (i << cache->offBitsNum);
+			iov.len = cache->lineSize;
+
+			stripe = cache_lockSet(cache, cache_computeSetIndex(cache, lineAddr));
+			linePtr = cache_findIdleLine(cache, stripe, lineAddr);
+			if (linePtr != NULL && linePtr->validMask == cache->sectorsMask) {
+				cache_bypassOverlay(cache, linePtr, iov.buf);
+				mutexUnlock(stripe->lock);
+				continue;
+			}
+
+			if (linePtr != NULL) {
+				cache_claimLine(linePtr);
+			}
+			mutexUnlock(stripe->lock);
+
+			err = cache_devTransfer(cache, lineAddr, &iov, 1, 0);
+
+			if (linePtr != NULL) {
+				cache_lockStripe(stripe);
+				if (err >= 0) {
+					cache_bypassOverlay(cache, linePtr, iov.buf);
+				}
+				cache_releaseLine(stripe, linePtr);
+				mutexUnlock(stripe->lock);
+			}
+
+			if (err < 0) {
+				return err;
+			}
+		}
+	}
+
+	return EOK;
+}
+
+
+/* Transfers line aligned range directly between device and caller buffer, keeping resident lines coherent */
+static int cache_bypass(cachectx_t *cache, uint64_t addr, void *buffer, size_t count, int write)
+{
+	int err = EOK;
+	size_t pos, len;
+	cache_iov_t iov;
+
+	if (write == 0) {
+		err = cache_bypassRead(cache, addr, buffer, count);
+	}
+	else {
+		/*
+		 * Write-backs in flight complete before device write. Dirty lines take new data now, as their later
+		 * write-back would overwrite it on device otherwise. Clean lines are left as they are until it succeeds.
+		 */
+		cache_bypassSync(cache, addr, buffer, count, 1);
+	}
+
+	for (pos = 0; write != 0 && err == EOK && pos < count; pos += len) {
+		len = count - pos;
+
+		/* Writes never cross program unit boundary */
+		if (cache->progUnit != 0 && len > cache->progUnit - ((addr + pos) & (cache->progUnit - 1))) {
+			len = cache->progUnit - ((addr + pos) & (cache->progUnit - 1));
+		}
+
+		iov.buf = (unsigned char *)buffer + pos;
+		iov.len = len;
+		err = cache_devTransfer(cache, addr + pos, &iov, 1, write);
+	}
+
+	if (err == EOK) {
+		/* Lines cached before write or fetched during it are older than device */
+		if (write != 0) {
+			cache_bypassSync(cache, addr, buffer, count, 0);
+		}
+
+		atomic_fetch_add_explicit(&cache->counters.bypassed, count, memory_order_relaxed);
+	}
+
+	return err;
+}
+
+
+/* Splits transfer into partial head and tail lines going through cache and line aligned body bypassing it */
+static ssize_t cache_bypassTransfer(cachectx_t *cache, uint64_t addr, void *buffer, size_t count, int write, int policy)
+{
+	int err;
+	ssize_t ret;
+	size_t head, body;
+
+	head = (cache->lineSize - cache_computeOffset(cache, addr)) & cache->offMask;
+	body = (count - head) & ~(size_t)cache->offMask;
+
+	if (head > 0) {
+		ret = (write != 0) ? cache_writeLines(cache, addr, buffer, head, policy) : cache_readLines(cache, addr, buffer, head);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	err = cache_bypass(cache, addr + head, (unsigned char *)buffer + head, body, write);
+	if (err < 0) {
+		return err;
+	}
+
+	if (head + body < count) {
+		addr += head + body;
+		buffer = (unsigned char *)buffer + head + body;
+		ret = (write != 0) ? cache_writeLines(cache, addr, buffer, count - head - body, policy) : cache_readLines(cache, addr, buffer, count - head - body);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return count;
+}
+
+
+ssize_t cache_write(cachectx_t *cache, uint64_t addr, const void *buffer, size_t count, int policy)
+{
+	ssize_t ret;
+
+	if (buffer == NULL || (policy != LIBCACHE_WRITE_BACK && policy != LIBCACHE_WRITE_THROUGH) || addr > cache->srcMemSize) {
+		return -EINVAL;
+	}
+	if (count == 0) {
+		return 0;
+	}
+	if ((addr < cache->srcMemSize) && (addr + count > cache->srcMemSize)) {
+		count = cache->srcMemSize - addr;
+	}
+
+	cache_enter(cache);
+	if (count >= cache->bypassSize) {
+		ret = cache_bypassTransfer(cache, addr, (void *)buffer, count, 1, policy);
+	}
+	else {
+		ret = cache_writeLines(cache, addr, buffer, count, policy);
+	}
+	cache_leave(cache);
+
+	return ret;
+}
+
+
+ssize_t cache_read(cachectx_t *cache, uint64_t addr, void *buffer, size_t count)
+{
+	ssize_t ret;
+
+	if (buffer == NULL || addr > cache->srcMemSize) {
+		return -EINVAL;
+	}
+	if (count == 0) {
+		return 0;
+	}
+	if ((addr < cache->srcMemSize) && (addr + count > cache->srcMemSize)) {
+		count = cache->srcMemSize - addr;
+	}
+
+	cache_enter(cache);
+	if (count >= cache->bypassSize) {
+		ret = cache_bypassTransfer(cache, addr, buffer, count, 0, 0);
+	}
+	else {
+		if (cache->ra != NULL) {
+			cache_raUpdate(cache, addr, count);
+		}
+
+		ret = cache_readLines(cache, addr, buffer, count);
+	}
+	cache_leave(cache);
+
+	return ret;
+}
+
+
+/* Length of segment clamped to source memory, -EINVAL if segment is invalid */
+static ssize_t cache_segLen(const cachectx_t *cache, const cache_seg_t *seg)
+{
+	if (seg->buf == NULL || seg->addr > cache->srcMemSize) {
+		return -EINVAL;
+	}
+
+	if (seg->addr + seg->len > cache->srcMemSize) {
+		return cache->srcMemSize - seg->addr;
+	}
+
+	return seg->len;
+}
+
+
+/* Collects indexes of up to LIBCACHE_SCAN_BATCH non-empty segments transferred through lines, sorted by address */
+static size_t cache_sortSegs(const cachectx_t *cache, const cache_seg_t *segs, size_t segcnt, size_t *idx)
+{
+	size_t i, j, n = 0;
+	ssize_t len;
+
+	for (i = 0; i < segcnt && n < LIBCACHE_SCAN_BATCH; ++i) {
+		len = cache_segLen(cache, &segs[i]);
+		if (len == 0 || (size_t)len >= cache->bypassSize) {
+			continue;
+		}
+
+		for (j = n++; j > 0 && segs[idx[j - 1]].addr > segs[i].addr; --j) {
+			idx[j] = idx[j - 1];
+		}
+		idx[j] = i;
+	}
+
+	return n;
+}
+
+
+/* Returns next range of lines [beg, end) covered by sorted segments without gaps, *pos is advanced past them */
+static void cache_segExtent(const cachectx_t *cache, const cache_seg_t *segs, const size_t *idx, size_t n, size_t *pos, uint64_t *beg, uint64_t *end)
+{
+	size_t i = *pos;
+	uint64_t segEnd;
+
+	*beg = segs[idx[i]].addr & ~cache->offMask;
+	*end = *beg;
+
+	for (; i < n && (segs[idx[i]].addr & ~cache->offMask) <= *end; ++i) {
+		segEnd = (segs[idx[i]].addr + cache_segLen(cache, &segs[idx[i]]) + cache->lineSize - 1) & ~cache->offMask;
+		if (segEnd > *end) {
+			*end = segEnd;
+		}
+	}
+
+	*pos = i;
+}
+
+
+/* Copies data of line at addr to all segments overlapping it, returns mask of sectors needed if data is NULL */
+static uint64_t cache_segCopy(const cachectx_t *cache, const cache_seg_t *segs, const size_t *idx, size_t n, uint64_t addr, const void *data)
+{
+	size_t i;
+	uint64_t from, to, need = 0;
+
+	for (i = 0; i < n && segs[idx[i]].addr < addr + cache->lineSize; ++i) {
+		from = (segs[idx[i]].addr > addr) ? segs[idx[i]].addr : addr;
+		to = segs[idx[i]].addr + cache_segLen(cache, &segs[idx[i]]);
+		if (to > addr + cache->lineSize) {
+			to = addr + cache->lineSize;
+		}
+
+		if (from >= to) {
+			continue;
+		}
+
+		if (data == NULL) {
+			need |= cache_sectorMask(cache, from - addr, to - from);
+		}
+		else {
+			memcpy((unsigned char *)segs[idx[i]].buf + (from - segs[idx[i]].addr), (const unsigned char *)data + (from - addr), to - from);
+		}
+	}
+
+	return need;
+}
+
+
+/* Reads batch of sorted segments, every line is looked up once even if several segments share it */
+static int cache_readSegs(cachectx_t *cache, const cache_seg_t *segs, const size_t *idx, size_t n)
+{
+	int err;
+	size_t pos = 0, first, last, lines, runPos = 0, runLen = 0;
+	uint64_t addr, end, index;
+	cacheline_t *linePtr, *run[LIBCACHE_IO_MAX];
+	cachestripe_t *stripe;
+
+	while (pos < n) {
+		first = pos;
+		cache_segExtent(cache, segs, idx, n, &pos, &addr, &end);
+		last = pos;
+
+		if (cache->ra != NULL) {
+			cache_raUpdate(cache, addr, end - addr);
+		}
+
+		for (; addr < end; addr += cache->lineSize) {
+			/* Misses on consecutive lines of extent are fetched with a single device access, as in cache_readLines() */
+			lines = (end - addr) >> cache->offBitsNum;
+			if (runPos == runLen && cache->ioLines > 1 && lines > 1) {
+				err = cache_fetchRun(cache, addr, (lines < cache->ioLines) ? lines : cache->ioLines, run, LIBCACHE_FETCH_DEMAND);
+				if (err < 0) {
+					return err;
+				}
+				runPos = 0;
+				runLen = err;
+			}
+
+			/* Segments ending before this line are skipped */
+			while (first < last && segs[idx[first]].addr + cache_segLen(cache, &segs[idx[first]]) <= addr) {
+				first++;
+			}
+
+			index = cache_computeSetIndex(cache, addr);
+			stripe = cache_lockSet(cache, index);
+
+			if (runPos < runLen) {
+				linePtr = run[runPos++];
+			}
+			else {
+				err = cache_getLine(cache, stripe, addr, cache_segCopy(cache, segs, &idx[first], last - first, addr, NULL), cache->sectorsMask, &linePtr);
+				if (err < 0) {
+					mutexUnlock(stripe->lock);
+					return err;
+				}
+			}
+
+			cache_segCopy(cache, segs, &idx[first], last - first, addr, linePtr->data);
+
+			if (IS_BUSY(linePtr->flags)) {
+				cache_releaseLine(stripe, linePtr);
+			}
+
+			mutexUnlock(stripe->lock);
+		}
+	}
+
+	return EOK;
+}
+
+
+ssize_t cache_readv(cachectx_t *cache, const cache_seg_t *segs, size_t segcnt)
+{
+	int err;
+	size_t i, n, idx[LIBCACHE_SCAN_BATCH];
+	ssize_t len, total = 0;
+
+	if (segs == NULL && segcnt != 0) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < segcnt; ++i) {
+		len = cache_segLen(cache, &segs[i]);
+		if (len < 0) {
+			return len;
+		}
+		total += len;
+	}
+
+	cache_enter(cache);
+
+	/* Large segments skip line buffers as in cache_read() */
+	for (i = 0; i < segcnt && total >= 0; ++i) {
+		len = cache_segLen(cache, &segs[i]);
+		if (len != 0 && (size_t)len >= cache->bypassSize) {
+			len = cache_bypassTransfer(cache, segs[i].addr, segs[i].buf, len, 0, 0);
+			if (len < 0) {
+				total = len;
+			}
+		}
+	}
+
+	for (i = 0; i < segcnt && total >= 0; i += LIBCACHE_SCAN_BATCH) {
+		n = cache_sortSegs(cache, &segs[i], (segcnt - i < LIBCACHE_SCAN_BATCH) ? segcnt - i : LIBCACHE_SCAN_BATCH, idx);
+		err = cache_readSegs(cache, &segs[i], idx, n);
+		if (err < 0) {
+			total = err;
+		}
+	}
+
+	cache_leave(cache);
+
+	return total;
+}
+
+
+ssize_t cache_writev(cachectx_t *cache, const cache_seg_t *segs, size_t segcnt, int policy)
+{
+	int err;
+	size_t i, n, pos, idx[LIBCACHE_SCAN_BATCH];
+	ssize_t len, total = 0;
+	uint64_t beg, end;
+
+	if ((segs == NULL && segcnt != 0) || (policy != LIBCACHE_WRITE_BACK && policy != LIBCACHE_WRITE_THROUGH)) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < segcnt; ++i) {
+		len = cache_segLen(cache, &segs[i]);
+		if (len < 0) {
+			return len;
+		}
+		total += len;
+	}
+
+	cache_enter(cache);
+
+	/* Segments are written in given order, so overlapping ones behave as consecutive cache_write() calls */
+	for (i = 0; i < segcnt && total >= 0; ++i) {
+		len = cache_segLen(cache, &segs[i]);
+		if (len == 0) {
+			continue;
+		}
+
+		if ((size_t)len >= cache->bypassSize) {
+			len = cache_bypassTransfer(cache, segs[i].addr, segs[i].buf, len, 1, policy);
+		}
+		else {
+			len = cache_writeLines(cache, segs[i].addr, segs[i].buf, len, LIBCACHE_WRITE_BACK);
+		}
+
+		if (len < 0) {
+			total = len;
+		}
+	}
+
+	/* Written through lines are written back afterwards, adjacent ones with single device access */
+	for (i = 0; policy == LIBCACHE_WRITE_THROUGH && i < segcnt && total >= 0; i += LIBCACHE_SCAN_BATCH) {
+		n = cache_sortSegs(cache, &segs[i], (segcnt - i < LIBCACHE_SCAN_BATCH) ? segcnt - i : LIBCACHE_SCAN_BATCH, idx);
+
+		for (pos = 0; pos < n && total >= 0;) {
+			cache_segExtent(cache, &segs[i], idx, n, &pos, &beg, &end);
+			err = cache_flushRange(cache, beg, (end < cache->srcMemSize) ? end : cache->srcMemSize, 0);
+			if (err < 0) {
+				total = err;
+			}
+		}
+	}
+
+	cache_leave(cache);
+
+	return total;
+}
+
+
+int cache_pin(cachectx_t *cache, uint64_t addr, size_t count, void **data)
+{
+	int err;
+	uint64_t offset = cache_computeOffset(cache, addr);
+	cacheline_t *linePtr;
+	cachestripe_t *stripe;
+
+	if (data == NULL || count == 0 || addr + count > cache->srcMemSize || offset + count > cache->lineSize) {
+		return -EINVAL;
+	}
+
+	cache_enter(cache);
+	stripe = cache_lockSet(cache, cache_computeSetIndex(cache, addr));
+
+	/* Unpinning may mark whole line dirty, so all of it has to be valid */
+	err = cache_getLine(cache, stripe, addr - offset, cache->sectorsMask, cache->sectorsMask, &linePtr);
+	if (err == EOK) {
+		linePtr->pins++;
+		*data = (unsigned char *)linePtr->data + offset;
+	}
+
+	mutexUnlock(stripe->lock);
+	cache_leave(cache);
+
+	return err;
+}
+
+
+/* Locks stripe of set holding addr without entering cache, geometry does not change while any stripe is locked */
+static cachestripe_t *cache_lockAddr(cachectx_t *cache, uint64_t addr, uint64_t *index)
+{
+	cachestripe_t *stripe = &cache->stripes[0], *next;
+
+	cache_lockStripe(stripe);
+
+	for (;;) {
+		*index = cache_computeSetIndex(cache, addr);
+		next = &cache->stripes[*index & cache->stripeMask];
+		if (next == stripe) {
+			return stripe;
+		}
+
+		mutexUnlock(stripe->lock);
+		stripe = next;
+		cache_lockStripe(stripe);
+	}
+}
+
+
+/*
+ * Pinned line survives resize, so it is looked up under its stripe lock only. Waiting at the gate could
+ * deadlock with resize waiting for a call which itself waits for the pin to be released.
+ */
+int cache_unpin(cachectx_t *cache, uint64_t addr, int dirty)
+{
+	int err = EOK;
+	uint64_t index;
+	cacheline_t *linePtr;
+	cachestripe_t *stripe;
+
+	for (;;) {
+		stripe = cache_lockAddr(cache, addr, &index);
+
+		linePtr = cache_findLine(cache, &cache->sets[index], cache_computeTag(cache, addr), LIBCACHE_TIMESTAMPS_NO_UPDATE);
+		if (linePtr == NULL || linePtr->pins == 0) {
+			err = -EINVAL;
+			break;
+		}
+
+		/* Write-back in progress would mark line clean once it completes, line may be moved meanwhile */
+		if (dirty == 0 || !IS_BUSY(linePtr->flags)) {
+			break;
+		}
+
+		cache_waitLine(stripe);
+		mutexUnlock(stripe->lock);
+	}
+
+	if (err == EOK) {
+		if (dirty != 0) {
+			cache_markDirty(cache, linePtr, 0, cache->lineSize);
+		}
+
+		/* Allocations waiting for evictable line are woken up */
+		linePtr->pins--;
+		if (linePtr->pins == 0) {
+			condBroadcast(stripe->cond);
+		}
+	}
+
+	mutexUnlock(stripe->lock);
+
+	return err;
+}
+
+
+/* Invalidates line holding addr once it is idle, -EBUSY if it is pinned */
+static int cache_invalidateAddr(cachectx_t *cache, uint64_t addr)
+{
+	int ret = EOK;
+	uint64_t index = cache_computeSetIndex(cache, addr);
+	cacheline_t *linePtr;
+	cachestripe_t *stripe;
+
+	stripe = cache_lockSet(cache, index);
+
+	linePtr = cache_findIdleLine(cache, stripe, addr);
+	if (linePtr != NULL) {
+		if (linePtr->pins != 0) {
+			ret = -EBUSY;
+		}
+		else {
+			cache_invalidateLine(cache, &cache->sets[index], linePtr);
+		}
+	}
+
+	mutexUnlock(stripe->lock);
+
+	return ret;
+}
+
+
+/* Calls fn for resident lines of [addr, end) in address order, walking resident lists if cheaper. Returns -EBUSY if any call failed */
+static int cache_rangeApply(cachectx_t *cache, uint64_t addr, const uint64_t end, int (*fn)(cachectx_t *, uint64_t))
+{
+	int ret = EOK;
+	size_t i, n = LIBCACHE_SCAN_BATCH;
+	uint64_t batch[LIBCACHE_SCAN_BATCH];
+
+	addr -= cache_computeOffset(cache, addr);
+
+	if (cache_scanLists(cache, addr, end, 0) == 0) {
+		for (; addr < end; addr += cache->lineSize) {
+			if (fn(cache, addr) < 0) {
+				ret = -EBUSY;
+			}
+		}
+
+		return ret;
+	}
+
+	while (n == LIBCACHE_SCAN_BATCH) {
+		n = cache_collectLines(cache, addr, end, 0, batch);
+
+		for (i = 0; i < n; ++i) {
+			if (fn(cache, batch[i]) < 0) {
+				ret = -EBUSY;
+			}
+		}
+
+		if (n != 0) {
+			addr = batch[n - 1] + cache->lineSize;
+		}
+	}
+
+	return ret;
+}
+
+
+int cache_invalidate(cachectx_t *cache, const uint64_t begAddr, const uint64_t endAddr)
+{
+	int err;
+	uint64_t end = endAddr;
+
+	if (begAddr > endAddr || begAddr > cache->srcMemSize) {
+		return -EINVAL;
+	}
+	if (begAddr < cache->srcMemSize && endAddr > cache->srcMemSize) {
+		end = cache->srcMemSize;
+	}
+
+	/* Pinned line data is in use, rest of range is invalidated anyway */
+	cache_enter(cache);
+	err = cache_rangeApply(cache, begAddr, end, cache_invalidateAddr);
+	cache_leave(cache);
+
+	return err;
+}
+
+
+/* Drops clean line holding addr, dirty line is only demoted. Busy and pinned lines are left alone */
+static int cache_dontneedAddr(cachectx_t *cache, uint64_t addr)
+{
+	uint64_t index = cache_computeSetIndex(cache, addr);
+	cacheline_t *linePtr;
+	cachestripe_t *stripe;
+
+	stripe = cache_lockSet(cache, index);
+
+	linePtr = cache_findLine(cache, &cache->sets[index], cache_computeTag(cache, addr), LIBCACHE_TIMESTAMPS_NO_UPDATE);
+	if (linePtr != NULL && !IS_BUSY(linePtr->flags) && linePtr->pins == 0) {
+		if (IS_DIRTY(linePtr->flags)) {
+			cache->repl->demote(&cache->sets[index], linePtr);
+		}
+		else {
+			cache_invalidateLine(cache, &cache->sets[index], linePtr);
+		}
+	}
+
+	mutexUnlock(stripe->lock);
+
+	return EOK;
+}
+
+
+/* Replaces advice of line aligned range [beg, end), existing ranges are trimmed or split */
+static int cache_adviceSet(cachectx_t *cache, uint64_t beg, uint64_t end, int hint)
+{
+	int err = EOK;
+	unsigned int i, n = 0;
+	cacheadvice_t *adv, tbl[LIBCACHE_ADVICE_MAX + 2];
+
+	mutexLock(cache->adviceLock);
+
+	/* Ranges are disjoint, so only one of them may be split */
+	for (i = 0; i < atomic_load_explicit(&cache->adviceCnt, memory_order_relaxed); ++i) {
+		adv = &cache->advice[i];
+		if (adv->end <= beg || adv->beg >= end) {
+			tbl[n++] = *adv;
+			continue;
+		}
+
+		if (adv->beg < beg) {
+			tbl[n].beg = adv->beg;
+			tbl[n].end = beg;
+			tbl[n++].hint = adv->hint;
+		}
+
+		if (adv->end > end) {
+			tbl[n].beg = end;
+			tbl[n].end = adv->end;
+			tbl[n++].hint = adv->hint;
+		}
+	}
+
+	if (hint != LIBCACHE_ADVICE_NORMAL) {
+		tbl[n].beg = beg;
+		tbl[n].end = end;
+		tbl[n++].hint = hint;
+	}
+
+	if (n > LIBCACHE_ADVICE_MAX) {
+		err = -ENOSPC;
+	}
+	else {
+		atomic_store_explicit(&cache->adviceSeq, atomic_load_explicit(&cache->adviceSeq, memory_order_relaxed) + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+
+		memcpy(cache->advice, tbl, n * sizeof(cacheadvice_t));
+		atomic_store_explicit(&cache->adviceCnt, n, memory_order_relaxed);
+
+		atomic_store_explicit(&cache->adviceSeq, atomic_load_explicit(&cache->adviceSeq, memory_order_relaxed) + 1, memory_order_release);
+	}
+
+	mutexUnlock(cache->adviceLock);
+
+	return err;
+}
+
+
+int cache_advise(cachectx_t *cache, const uint64_t begAddr, const uint64_t endAddr, int hint)
+{
+	int err, queued = 0;
+	uint64_t beg, end = endAddr;
+
+	if (begAddr > endAddr || begAddr > cache->srcMemSize) {
+		return -EINVAL;
+	}
+	if (begAddr < cache->srcMemSize && endAddr > cache->srcMemSize) {
+		end = cache->srcMemSize;
+	}
+	if (begAddr == end) {
+		return EOK;
+	}
+
+	beg = begAddr >> cache->offBitsNum;
+	end = ((end - 1) >> cache->offBitsNum) + 1;
+
+	switch (hint) {
+		case LIBCACHE_ADVICE_NORMAL:
+		case LIBCACHE_ADVICE_SEQUENTIAL:
+		case LIBCACHE_ADVICE_RANDOM:
+		case LIBCACHE_ADVICE_NOREUSE:
+			return cache_adviceSet(cache, beg << cache->offBitsNum, end << cache->offBitsNum, hint);
+
+		case LIBCACHE_ADVICE_WILLNEED:
+			/* Lines beyond capacity would only evict ones prefetched before them */
+			if (end - beg > cache->linesCnt) {
+				end = beg + cache->linesCnt;
+			}
+
+			/* Read-ahead thread fetches lines without blocking caller */
+			if (cache->ra != NULL) {
+				mutexLock(cache->ra->thr.lock);
+				queued = cache_raQueue(cache->ra, beg, end);
+				mutexUnlock(cache->ra->thr.lock);
+			}
+
+			if (queued != 0) {
+				return EOK;
+			}
+
+			cache_enter(cache);
+			err = cache_prefetch(cache, beg, end);
+			cache_leave(cache);
+
+			return err;
+
+		case LIBCACHE_ADVICE_DONTNEED:
+			cache_enter(cache);
+			cache_rangeApply(cache, beg << cache->offBitsNum, end << cache->offBitsNum, cache_dontneedAddr);
+			cache_leave(cache);
+
+			return EOK;
+
+		default:
+			return -EINVAL;
+	}
+}
+
+
+int cache_clean(cachectx_t *cache, const uint64_t begAddr, const uint64_t endAddr)
+{
+	int err;
+	uint64_t end = endAddr;
+
+	if (begAddr > endAddr || begAddr > cache->srcMemSize) {
+		return -EINVAL;
+	}
+	if (begAddr < cache->srcMemSize && endAddr > cache->srcMemSize) {
+		end = cache->srcMemSize;
+	}
+
+	atomic_fetch_add_explicit(&cache->counters.flushes, 1, memory_order_relaxed);
+
+	cache_enter(cache);
+	err = cache_flushRange(cache, begAddr, end, 1);
+	cache_leave(cache);
 
-	return EOK;
+	return err;
 }
 
 
-static int cache_compareTags(const void *lhs, const void *rhs)
+/* Holds back new calls until running ones leave, then locks all stripes against pool reclaim of other caches */
+static void cache_resizeBegin(cachectx_t *cache)
 {
-	int ret = 0;
-
-	cacheline_t **lhsLine = (cacheline_t **)lhs;
-	cacheline_t **rhsLine = (cacheline_t **)rhs;
+	size_t i;
 
-	if (*lhsLine == NULL && *rhsLine == NULL) {
-		ret = 0;
-	}
-	else if (*lhsLine == NULL && *rhsLine != NULL) {
-		ret = -1;
-	}
-	else if (*lhsLine != NULL && *rhsLine == NULL) {
-		ret = 1;
-	}
-	else {
-		if ((*lhsLine)->tag < (*rhsLine)->tag) {
-			ret = -1;
-		}
-		else if ((*lhsLine)->tag == (*rhsLine)->tag) {
-			ret = 0;
-		}
-		else {
-			ret = 1;
-		}
+	mutexLock(cache->gateLock);
+	atomic_store(&cache->resizing, 1);
+	while (atomic_load(&cache->active) != 0) {
+		condWait(cache->gateCond, cache->gateLock, 0);
 	}
+	mutexUnlock(cache->gateLock);
 
-	return ret;
+	for (i = 0; i <= cache->stripeMask; ++i) {
+		mutexLock(cache->stripes[i].lock);
+	}
 }
 
 
-static int cache_executePolicy(cachectx_t *cache, cacheline_t *linePtr, uint64_t addr, int policy)
+static void cache_resizeEnd(cachectx_t *cache)
 {
-	if (policy == LIBCACHE_WRITE_THROUGH) {
-		return cache_flushLine(cache, linePtr, addr);
+	size_t i;
+
+	for (i = 0; i <= cache->stripeMask; ++i) {
+		mutexUnlock(cache->stripes[i].lock);
 	}
 
-	return 0;
+	mutexLock(cache->gateLock);
+	atomic_store(&cache->resizing, 0);
+	condBroadcast(cache->gateCond);
+	mutexUnlock(cache->gateLock);
 }
 
 
-static cacheline_t *cache_allocateLine(cachectx_t *cache, const uint64_t setIndex, const uint64_t tag)
+/*
+ * Ranks valid lines, pinned ones first and the rest by recency rank within set, and assigns them ways of next
+ * geometry. moved[i] is NULL if ranked[i] does not fit, addresses of such dirty lines are stored in dirty.
+ * Returns number of ranked lines, -EBUSY if line in use would be dropped or moved to other buffer.
+ */
+static ssize_t cache_resizePlan(cachectx_t *cache, cachectx_t *next, cacheline_t **ranked, cacheline_t **moved, size_t *fill, uint64_t *dirty, size_t *dirtyCnt)
 {
-	int i;
-	uint64_t addr = 0;
-	cacheline_t *linePtr = NULL;
-	cacheset_t *setPtr = &cache->sets[setIndex];
-
-	if (setPtr->count < LIBCACHE_NUM_WAYS) {
-		/* Set is not full, so there must be an invalid line in set */
-		setPtr->count++;
+	size_t i, rank, n = 0;
+	uint64_t addr, index;
+	cacheline_t *linePtr;
+
+	*dirtyCnt = 0;
+
+	/* Recency order of sets is kept in moved until lines are ranked */
+	for (i = 0; i < cache->numSets; ++i) {
+		cache_applyHits(cache, &cache->sets[i]);
+		rank = cache->repl->order(cache, &cache->sets[i], &moved[i * cache->numWays]);
+		for (; rank < cache->numWays; ++rank) {
+			moved[i * cache->numWays + rank] = NULL;
+		}
+	}
 
-		for (i = 0; i < setPtr->count; ++i) {
-			if (!IS_VALID(setPtr->lines[i].flags)) {
-				linePtr = &(setPtr->lines[i]);
-				break;
-			}
+	for (i = 0; i < cache->linesCnt; ++i) {
+		if (moved[i] != NULL && moved[i]->pins != 0) {
+			ranked[n++] = moved[i];
 		}
+	}
 
-		for (i = 0; i < setPtr->count; ++i) {
-			if (setPtr->tags[i] == NULL) {
-				setPtr->tags[i] = linePtr;
-				break;
+	for (rank = 0; rank < cache->numWays; ++rank) {
+		for (i = 0; i < cache->numSets; ++i) {
+			linePtr = moved[i * cache->numWays + rank];
+			if (linePtr != NULL && linePtr->pins == 0) {
+				ranked[n++] = linePtr;
 			}
 		}
+	}
 
-		if (linePtr->data == NULL) {
-			linePtr->data = malloc(cache->lineSize);
+	memset(fill, 0, next->numSets * sizeof(size_t));
 
-			if (linePtr->data == NULL) {
-				setPtr->count--;
-				return NULL;
-			}
+	for (i = 0; i < n; ++i) {
+		linePtr = ranked[i];
+
+		/* Pinned data is copied to new arena */
+		if (IS_BUSY(linePtr->flags) || (linePtr->pins != 0 && next->arena != NULL)) {
+			return -EBUSY;
 		}
-	}
-	else {
-		/* Set is full, take least recently used valid line from set */
-		linePtr = setPtr->timestamps;
 
-		if (IS_DIRTY(linePtr->flags)) {
-			addr = cache_computeAddr(cache, linePtr->tag, setIndex);
-			int err = cache_flushLine(cache, linePtr, addr);
-			if (err < 0) {
-				return NULL;
+		addr = cache_computeAddr(cache, linePtr->tag, cache_lineSet(cache, linePtr));
+		index = cache_computeSetIndex(next, addr);
+
+		if (fill[index] < next->numWays) {
+			moved[i] = &next->sets[index].lines[fill[index]++];
+		}
+		else if (linePtr->pins != 0) {
+			return -EBUSY;
+		}
+		else {
+			moved[i] = NULL;
+			if (IS_DIRTY(linePtr->flags)) {
+				dirty[(*dirtyCnt)++] = addr;
 			}
 		}
-
-		LIST_REMOVE(&setPtr->timestamps, linePtr);
 	}
 
-	LIST_ADD(&setPtr->timestamps, linePtr);
-	linePtr->tag = tag;
-	unsigned char flags = 0;
-	SET_VALID(flags);
-	linePtr->flags = flags;
-
-	qsort(setPtr->tags, LIBCACHE_NUM_WAYS, sizeof(cacheline_t *), cache_compareTags);
-
-	return linePtr;
+	return n;
 }
 
 
-static cacheline_t *cache_findLine(cacheset_t *setPtr, uint64_t tag, int update)
+/* Moves lines to ways assigned by cache_resizePlan(), next is left with previous sets */
+static void cache_rehash(cachectx_t *cache, cachectx_t *next, cacheline_t **ranked, cacheline_t **moved, size_t n)
 {
-	cacheline_t key, *keyPtr = &key, *linePtr = NULL, **temp = NULL;
+	size_t i, linesCnt, numWays;
+	unsigned int validCnt = 0, dirtyCnt = 0;
+	uint64_t addr, index;
+	void *ptr;
+	cacheline_t *linePtr, *newPtr;
+	cacheset_t *setPtr;
+	cachestripe_t *stripe;
+
+	for (i = 0; i <= cache->stripeMask; ++i) {
+		cache->stripes[i].valid = NULL;
+		cache->stripes[i].dirty = NULL;
+	}
+
+	/* Least valuable lines are inserted first, so they end up least recently used */
+	for (i = n; i-- > 0;) {
+		linePtr = ranked[i];
+		newPtr = moved[i];
+		index = cache_lineSet(cache, linePtr);
+		addr = cache_computeAddr(cache, linePtr->tag, index);
+
+		if (newPtr == NULL) {
+			cache->stripes[index & cache->stripeMask].stats.evictions++;
+			if (cache->pool != NULL) {
+				cache_poolPut(cache, linePtr->data);
+			}
+			else if (cache->arena == NULL) {
+				free(linePtr->data);
+			}
+			linePtr->data = NULL;
+			continue;
+		}
 
-	key.tag = tag;
+		index = cache_computeSetIndex(next, addr);
+		setPtr = &next->sets[index];
 
-	temp = bsearch(&keyPtr, setPtr->tags, LIBCACHE_NUM_WAYS, sizeof(cacheline_t *), cache_compareTags);
+		if (next->arena != NULL) {
+			memcpy(newPtr->data, linePtr->data, cache->lineSize);
+		}
+		else {
+			newPtr->data = linePtr->data;
+			linePtr->data = NULL;
+		}
 
-	if (temp != NULL && IS_VALID((*temp)->flags)) {
-		if (update != LIBCACHE_TIMESTAMPS_NO_UPDATE) {
-			LIST_REMOVE(&setPtr->timestamps, *temp);
-			LIST_ADD(&setPtr->timestamps, *temp);
+		newPtr->tag = cache_computeTag(next, addr);
+		newPtr->validMask = linePtr->validMask;
+		newPtr->dirtyMask = linePtr->dirtyMask;
+		newPtr->partBeg = linePtr->partBeg;
+		newPtr->partEnd = linePtr->partEnd;
+		newPtr->dirtyTime = linePtr->dirtyTime;
+		newPtr->pins = linePtr->pins;
+		newPtr->stamp = linePtr->stamp;
+		newPtr->flags = linePtr->flags;
+		CLEAR_PROBATION(newPtr->flags);
+
+		/* Lines of 2Q main list are readmitted there as on ghost hit */
+		if (next->ghostsCnt != 0 && !IS_PROBATION(linePtr->flags)) {
+			setPtr->ghosts[0] = newPtr->tag;
 		}
+		next->repl->insert(next, setPtr, newPtr);
+		cache_setFingerprint(setPtr, newPtr - setPtr->lines, cache_fingerprint(newPtr->tag));
+		setPtr->count++;
 
-		linePtr = *temp;
+		stripe = &cache->stripes[index & cache->stripeMask];
+		LIST_ADD_EX(&stripe->valid, newPtr, validNext, validPrev);
+		validCnt++;
+		if (IS_DIRTY(newPtr->flags)) {
+			LIST_ADD_EX(&stripe->dirty, newPtr, dirtyNext, dirtyPrev);
+			dirtyCnt++;
+		}
 	}
 
-	return linePtr;
-}
+	atomic_store_explicit(&cache->validCnt, validCnt, memory_order_relaxed);
+	atomic_store_explicit(&cache->dirtyCnt, dirtyCnt, memory_order_relaxed);
 
+	/* Previous sets are released along with next */
+	ptr = cache->sets;
+	cache->sets = next->sets;
+	next->sets = ptr;
 
-static uint64_t cache_computeOffset(const cachectx_t *cache, const uint64_t addr)
-{
-	return addr & cache->offMask;
-}
+	ptr = cache->lines;
+	cache->lines = next->lines;
+	next->lines = ptr;
 
+	ptr = cache->fps;
+	cache->fps = next->fps;
+	next->fps = ptr;
 
-static uint64_t cache_computeSetIndex(const cachectx_t *cache, const uint64_t addr)
-{
-	return (addr >> cache->offBitsNum) & cache->setMask;
-}
+	ptr = cache->ghosts;
+	cache->ghosts = next->ghosts;
+	next->ghosts = ptr;
 
+	ptr = cache->arena;
+	cache->arena = next->arena;
+	next->arena = ptr;
 
-static uint64_t cache_computeTag(const cachectx_t *cache, const uint64_t addr)
-{
-	return (addr >> (cache->offBitsNum + cache->setBitsNum)) & cache->tagMask;
+	linesCnt = cache->linesCnt;
+	numWays = cache->numWays;
+	cache_setGeometry(cache, next->linesCnt, next->numWays);
+	cache_setGeometry(next, linesCnt, numWays);
+	cache->probMax = next->probMax;
+	cache->ghostsCnt = next->ghostsCnt;
 }
 
 
-static size_t cache_computeTempCount(const size_t left, const size_t lineSize, uint64_t *addr, uint64_t *offset, const size_t count, const size_t remainder)
+/* Adjusts limits derived from number of lines */
+static void cache_resizeLimits(cachectx_t *cache, size_t prevCnt)
 {
-	size_t tempCount = 0;
+	cacheflusher_t *fl = cache->flusher;
+	cachepool_t *pool = cache->pool;
+
+	if (fl != NULL) {
+		mutexLock(fl->thr.lock);
+		if (fl->high == prevCnt + 1) {
+			fl->high = (unsigned int)(cache->linesCnt + 1);
+			fl->low = fl->high / 2;
+		}
+		mutexUnlock(fl->thr.lock);
+	}
 
-	if (left == count) {
-		if (count <= (lineSize - *offset)) {
-			tempCount = count;
+	if (pool != NULL) {
+		mutexLock(pool->lock);
+		if (cache->poolMax == prevCnt || cache->poolMax > cache->linesCnt) {
+			cache->poolMax = cache->linesCnt;
 		}
-		else {
-			tempCount = lineSize - *offset;
+		if (cache->poolMin > cache->poolMax) {
+			pool->minSum -= cache->poolMin - cache->poolMax;
+			cache->poolMin = cache->poolMax;
 		}
-		*addr -= *offset;
-	}
-	else {
-		*offset = 0;
-		tempCount = (left == remainder) ? remainder : lineSize;
+		mutexUnlock(pool->lock);
 	}
-
-	return tempCount;
 }
 
 
-static int cache_fetchLine(cachectx_t *cache, cacheline_t *linePtr, const uint64_t addr)
+int cache_resize(cachectx_t *cache, size_t linesCnt)
 {
-	uint64_t tempAddr = 0;
-	ssize_t readCount = 0, position = 0;
-	size_t left = cache->lineSize;
+	int err = EOK;
+	ssize_t n;
+	size_t i, tries, numWays, dirtyCnt, prevCnt;
+	uint64_t *dirty;
+	size_t *fill;
+	cacheline_t **ranked;
+	cachectx_t *next;
 
-	tempAddr = addr;
+	mutexLock(cache->resizeLock);
 
-	while (left > 0) {
-		readCount = cache->ops.readCb(tempAddr, (unsigned char *)linePtr->data + position, left, cache->ops.ctx);
-		if (readCount <= 0) {
-			return -EIO;
-		}
+	prevCnt = cache->linesCnt;
+	numWays = (cache->fullAssoc != 0) ? linesCnt : cache->numWays;
 
-		left -= readCount;
-		tempAddr += readCount;
-		position += readCount;
+	if (cache_checkGeometry(linesCnt, numWays) < 0) {
+		mutexUnlock(cache->resizeLock);
+		return -EINVAL;
 	}
 
-	return 0;
-}
+	if (linesCnt == prevCnt) {
+		mutexUnlock(cache->resizeLock);
+		return EOK;
+	}
 
+	next = calloc(1, sizeof(cachectx_t));
+	if (next == NULL) {
+		mutexUnlock(cache->resizeLock);
+		return -ENOMEM;
+	}
 
-ssize_t cache_write(cachectx_t *cache, uint64_t addr, const void *buffer, size_t count, int policy)
-{
-	ssize_t position = 0;
-	uint64_t index = 0, offset = 0, tag = 0;
-	size_t tempCount = 0, left = 0, remainder = 0;
-	cacheline_t *linePtr = NULL;
+	next->lineSize = cache->lineSize;
+	cache_setGeometry(next, linesCnt, numWays);
 
-	if (buffer == NULL || (policy != LIBCACHE_WRITE_BACK && policy != LIBCACHE_WRITE_THROUGH) || addr > cache->srcMemSize) {
-		return -EINVAL;
-	}
-	if (count == 0) {
-		return 0;
+	err = cache_replInit(next, (unsigned int)(cache->repl - cache_replOps));
+	if (err == EOK) {
+		err = cache_allocSets(next);
 	}
-	if ((addr < cache->srcMemSize) && (addr + count > cache->srcMemSize)) {
-		count = cache->srcMemSize - addr;
+	if (err == EOK && cache->arena != NULL) {
+		err = cache_allocArena(next, cache->lineAlign);
 	}
 
-	left = count;
-	offset = cache_computeOffset(cache, addr);
-	remainder = (left - (cache->lineSize - offset)) % cache->lineSize;
-
-	mutexLock(cache->lock);
-
-	while (left > 0) {
-		index = cache_computeSetIndex(cache, addr);
-		tag = cache_computeTag(cache, addr);
-
-		tempCount = cache_computeTempCount(left, cache->lineSize, &addr, &offset, count, remainder);
-
-		linePtr = cache_findLine(&cache->sets[index], tag, LIBCACHE_TIMESTAMPS_UPDATE);
-
-		/* cache miss */
-		if (linePtr == NULL) {
-			linePtr = cache_allocateLine(cache, index, tag);
+	ranked = malloc(2 * prevCnt * sizeof(cacheline_t *));
+	dirty = malloc(prevCnt * sizeof(uint64_t));
+	fill = malloc(next->numSets * sizeof(size_t));
+	if (ranked == NULL || dirty == NULL || fill == NULL) {
+		err = -ENOMEM;
+	}
 
-			if (linePtr == NULL) {
-				position = -ENOMEM;
-				break;
-			}
+	/* Only lines are moved while calls are held back, device is never accessed meanwhile */
+	for (tries = 0; err == EOK; ++tries) {
+		cache_resizeBegin(cache);
 
-			if (tempCount < cache->lineSize) {
-				int err = cache_fetchLine(cache, linePtr, addr);
-				if (err < 0) {
-					cache_invalidateLine(&cache->sets[index], linePtr);
-					position = err;
-					break;
-				}
-			}
+		n = cache_resizePlan(cache, next, ranked, &ranked[prevCnt], fill, dirty, &dirtyCnt);
+		if (n < 0) {
+			err = (int)n;
+		}
+		else if (dirtyCnt == 0) {
+			cache_rehash(cache, next, ranked, &ranked[prevCnt], n);
+		}
+		else if (tries == LIBCACHE_RESIZE_TRIES) {
+			/* Lines which do not fit keep getting dirty */
+			err = -EAGAIN;
 		}
-		/* cache hit */
-		memcpy((unsigned char *)linePtr->data + offset, (const unsigned char *)buffer + position, tempCount);
 
-		SET_DIRTY(linePtr->flags);
+		cache_resizeEnd(cache);
 
-		int err = cache_executePolicy(cache, linePtr, addr, policy);
-		if (err < 0) {
-			position = err;
+		if (err < 0 || dirtyCnt == 0) {
 			break;
 		}
 
-		position += tempCount;
-		left -= tempCount;
-		addr += cache->lineSize;
+		/* Dirty lines not fitting are written back while calls are served, some may get dirty again meanwhile */
+		for (i = 0; i < dirtyCnt && err == EOK; ++i) {
+			err = cache_flushRange(cache, dirty[i], dirty[i] + cache->lineSize, 0);
+		}
 	}
 
-	mutexUnlock(cache->lock);
+	if (err == EOK) {
+		cache_resizeLimits(cache, prevCnt);
+	}
 
-	return position;
+	mutexUnlock(cache->resizeLock);
+
+	free(fill);
+	free(dirty);
+	free(ranked);
+	cache_freeSets(next);
+	free(next);
+
+	return err;
 }
 
 
-ssize_t cache_read(cachectx_t *cache, uint64_t addr, void *buffer, size_t count)
+ssize_t cache_exportHot(cachectx_t *cache, void *blob, size_t size)
 {
-	ssize_t position = 0;
-	cacheline_t *linePtr = NULL;
-	uint64_t index = 0, offset = 0, tag = 0;
-	size_t tempCount, left = count, remainder = 0;
+	size_t i, rank, n, count = 0, maxCount;
+	uint64_t addr, *addrs;
+	unsigned char *out = (unsigned char *)blob + sizeof(cachehothdr_t);
+	cacheline_t **lines;
+	cachestripe_t *stripe;
+	cachehothdr_t hdr;
+
+	if (blob == NULL) {
+		return sizeof(cachehothdr_t) + cache->linesCnt * sizeof(uint64_t);
+	}
 
-	if (buffer == NULL || addr > cache->srcMemSize) {
+	if (size < sizeof(cachehothdr_t)) {
 		return -EINVAL;
 	}
-	if (count == 0) {
-		return 0;
+	maxCount = (size - sizeof(cachehothdr_t)) / sizeof(uint64_t);
+
+	cache_enter(cache);
+
+	/* Addresses of every set, most recently used first, LIBCACHE_HOT_NONE past the last valid line */
+	addrs = malloc(cache->linesCnt * sizeof(uint64_t));
+	lines = malloc(cache->numWays * sizeof(cacheline_t *));
+	if (addrs == NULL || lines == NULL) {
+		cache_leave(cache);
+		free(addrs);
+		free(lines);
+		return -ENOMEM;
 	}
-	if ((addr < cache->srcMemSize) && (addr + count > cache->srcMemSize)) {
-		count = cache->srcMemSize - addr;
+
+	for (i = 0; i < cache->numSets; ++i) {
+		stripe = cache_lockSet(cache, i);
+		cache_applyHits(cache, &cache->sets[i]);
+		n = cache->repl->order(cache, &cache->sets[i], lines);
+		for (rank = 0; rank < cache->numWays; ++rank) {
+			addrs[i * cache->numWays + rank] = (rank < n) ? cache_computeAddr(cache, lines[rank]->tag, i) : LIBCACHE_HOT_NONE;
+		}
+		mutexUnlock(stripe->lock);
 	}
 
-	left = count;
-	offset = cache_computeOffset(cache, addr);
-	remainder = (left - (cache->lineSize - offset)) % cache->lineSize;
+	/* Recency is comparable only within set, so lines are interleaved by their rank in set */
+	for (rank = 0; rank < cache->numWays && count < maxCount; ++rank) {
+		for (i = 0; i < cache->numSets && count < maxCount; ++i) {
+			addr = addrs[i * cache->numWays + rank];
+			if (addr != LIBCACHE_HOT_NONE) {
+				memcpy(out + count * sizeof(uint64_t), &addr, sizeof(uint64_t));
+				count++;
+			}
+		}
+	}
 
-	mutexLock(cache->lock);
+	cache_leave(cache);
 
-	while (left > 0) {
-		index = cache_computeSetIndex(cache, addr);
-		tag = cache_computeTag(cache, addr);
+	free(lines);
+	free(addrs);
 
-		tempCount = cache_computeTempCount(left, cache->lineSize, &addr, &offset, count, remainder);
+	hdr.magic = LIBCACHE_HOT_MAGIC;
+	hdr.version = LIBCACHE_HOT_VERSION;
+	hdr.lineSize = (uint32_t)cache->lineSize;
+	hdr.count = (uint32_t)count;
+	memcpy(blob, &hdr, sizeof(cachehothdr_t));
 
-		linePtr = cache_findLine(&cache->sets[index], tag, LIBCACHE_TIMESTAMPS_UPDATE);
+	return sizeof(cachehothdr_t) + count * sizeof(uint64_t);
+}
 
-		/* cache miss */
-		if (linePtr == NULL) {
-			linePtr = cache_allocateLine(cache, index, tag);
 
-			if (linePtr == NULL) {
-				position = -ENOMEM;
-				break;
-			}
+/* Prefetches lines covering [addr, addr + span) of every batch address, batch is sorted ascending */
+static int cache_warmBatch(cachectx_t *cache, const uint64_t *batch, size_t n, size_t span)
+{
+	int ret;
+	size_t i = 0, lines;
+	uint64_t beg, end, next = 0, limit;
+	cacheline_t *run[LIBCACHE_IO_MAX];
 
-			int err = cache_fetchLine(cache, linePtr, addr);
-			if (err < 0) {
-				cache_invalidateLine(&cache->sets[index], linePtr);
-				position = err;
-				break;
+	limit = ((uint64_t)cache->srcMemSize + cache->lineSize - 1) & ~cache->offMask;
+
+	while (i < n) {
+		beg = batch[i] & ~cache->offMask;
+		end = (batch[i] + span + cache->lineSize - 1) & ~cache->offMask;
+
+		/* Overlapping and adjacent ranges are fetched as one */
+		for (++i; i < n && (batch[i] & ~cache->offMask) <= end; ++i) {
+			if (((batch[i] + span + cache->lineSize - 1) & ~cache->offMask) > end) {
+				end = (batch[i] + span + cache->lineSize - 1) & ~cache->offMask;
 			}
 		}
-		/* cache hit */
-		memcpy((unsigned char *)buffer + position, (const unsigned char *)linePtr->data + offset, tempCount);
 
-		position += tempCount;
-		left -= tempCount;
-		addr += cache->lineSize;
-	}
+		if (beg < next) {
+			beg = next;
+		}
+		if (end > limit) {
+			end = limit;
+		}
+
+		while (beg < end) {
+			lines = (end - beg) >> cache->offBitsNum;
+			ret = cache_fetchRun(cache, beg, (lines < cache->ioLines) ? lines : cache->ioLines, run, LIBCACHE_FETCH_WARM);
+			if (ret < 0) {
+				return ret;
+			}
 
-	mutexUnlock(cache->lock);
+			/* Cached line ends run, it is skipped */
+			beg += (uint64_t)((ret > 0) ? ret : 1) << cache->offBitsNum;
+		}
+		next = end;
+	}
 
-	return position;
+	return EOK;
 }
 
 
-int cache_flush(cachectx_t *cache, const uint64_t begAddr, const uint64_t endAddr)
+int cache_importHot(cachectx_t *cache, const void *blob, size_t size)
 {
-	int ret = EOK;
-	uint64_t addr = 0, end = endAddr, tag = 0, index = 0, begOffset = 0;
-	cacheline_t *linePtr = NULL;
+	int err = EOK;
+	size_t i, j, m, n, count;
+	uint64_t addr, batch[LIBCACHE_SCAN_BATCH];
+	const unsigned char *in = (const unsigned char *)blob + sizeof(cachehothdr_t);
+	cachehothdr_t hdr;
 
-	if (begAddr > endAddr || begAddr > cache->srcMemSize) {
+	if (blob == NULL || size < sizeof(cachehothdr_t)) {
 		return -EINVAL;
 	}
 
-	if (begAddr < cache->srcMemSize && endAddr > cache->srcMemSize) {
-		end = cache->srcMemSize;
+	memcpy(&hdr, blob, sizeof(cachehothdr_t));
+	if (hdr.magic != LIBCACHE_HOT_MAGIC || hdr.version != LIBCACHE_HOT_VERSION || hdr.lineSize == 0 ||
+			hdr.count > (size - sizeof(cachehothdr_t)) / sizeof(uint64_t)) {
+		return -EINVAL;
 	}
 
-	begOffset = cache_computeOffset(cache, begAddr);
-	addr = begAddr - begOffset;
+	cache_enter(cache);
 
-	mutexLock(cache->lock);
+	/* Exported lines may differ in size, lines beyond capacity would only evict hotter ones */
+	count = cache->linesCnt * cache->lineSize / hdr.lineSize;
+	if (count > hdr.count) {
+		count = hdr.count;
+	}
 
-	while (addr < end) {
-		index = cache_computeSetIndex(cache, addr);
-		tag = cache_computeTag(cache, addr);
+	/* Hottest batch goes last, so it ends up most recently used */
+	while (err == EOK && count > 0) {
+		n = (count < LIBCACHE_SCAN_BATCH) ? count : LIBCACHE_SCAN_BATCH;
+		count -= n;
 
-		linePtr = cache_findLine(&cache->sets[index], tag, LIBCACHE_TIMESTAMPS_NO_UPDATE);
+		for (i = 0, m = 0; i < n; ++i) {
+			memcpy(&addr, in + (count + i) * sizeof(uint64_t), sizeof(uint64_t));
+			if (addr >= cache->srcMemSize) {
+				continue;
+			}
 
-		if (linePtr != NULL && IS_DIRTY(linePtr->flags)) {
-			ret = cache_flushLine(cache, linePtr, addr);
-			if (ret < 0) {
-				break;
+			for (j = m++; j > 0 && batch[j - 1] > addr; --j) {
+				batch[j] = batch[j - 1];
 			}
+			batch[j] = addr;
 		}
 
-		addr += cache->lineSize;
+		err = cache_warmBatch(cache, batch, m, hdr.lineSize);
 	}
 
-	mutexUnlock(cache->lock);
+	cache_leave(cache);
 
-	return ret;
+	return err;
 }
 
 
-static void cache_invalidateLine(cacheset_t *setPtr, cacheline_t *linePtr)
+/* Moves fast hits counted without lock to stripe stats, called with stripe lock held */
+static void cache_drainFastHits(cachestripe_t *stripe)
 {
-	LIST_REMOVE(&setPtr->timestamps, linePtr);
-
-	CLEAR_VALID(linePtr->flags);
-	free(linePtr->data);
-	linePtr->data = NULL;
-	linePtr->tag = 0;
+	unsigned long n = atomic_exchange_explicit(&stripe->fastHits, 0, memory_order_relaxed);
 
-	setPtr->count -= 1;
+	stripe->stats.hits += n;
+	stripe->stats.fastHits += n;
 }
 
 
-int cache_invalidate(cachectx_t *cache, const uint64_t begAddr, const uint64_t endAddr)
+static void cache_addStats(cache_stats_t *stats, const cache_stats_t *part)
 {
-	uint64_t addr = 0, end = endAddr, tag = 0, index = 0, begOffset = 0;
-	cacheline_t *linePtr = NULL;
-
-	if (begAddr > endAddr || begAddr > cache->srcMemSize) {
-		return -EINVAL;
-	}
-	if (begAddr < cache->srcMemSize && endAddr > cache->srcMemSize) {
-		end = cache->srcMemSize;
-	}
-
-	begOffset = cache_computeOffset(cache, begAddr);
-	addr = begAddr - begOffset;
+	stats->hits += part->hits;
+	stats->fastHits += part->fastHits;
+	stats->misses += part->misses;
+	stats->evictions += part->evictions;
+	stats->dirtyEvictions += part->dirtyEvictions;
+	stats->raLines += part->raLines;
+	stats->raHits += part->raHits;
+	stats->warmLines += part->warmLines;
+	stats->poolReclaims += part->poolReclaims;
+	stats->devReads += part->devReads;
+	stats->devWrites += part->devWrites;
+	stats->bytesRead += part->bytesRead;
+	stats->bytesWritten += part->bytesWritten;
+	stats->bypassed += part->bypassed;
+	stats->flushes += part->flushes;
+	stats->linesFlushed += part->linesFlushed;
+	stats->lockAcquires += part->lockAcquires;
+	stats->lockContended += part->lockContended;
+	stats->lockWaitTime += part->lockWaitTime;
+}
 
-	mutexLock(cache->lock);
 
-	while (addr < end) {
-		index = cache_computeSetIndex(cache, addr);
-		tag = cache_computeTag(cache, addr);
+void cache_getStats(cachectx_t *cache, cache_stats_t *stats)
+{
+	size_t i;
+	cachestripe_t *stripe;
 
-		linePtr = cache_findLine(&cache->sets[index], tag, LIBCACHE_TIMESTAMPS_NO_UPDATE);
+	memset(stats, 0, sizeof(cache_stats_t));
 
-		if (linePtr != NULL) {
-			cache_invalidateLine(&cache->sets[index], linePtr);
-		}
+	for (i = 0; i <= cache->stripeMask; ++i) {
+		stripe = &cache->stripes[i];
 
-		addr += cache->lineSize;
+		mutexLock(stripe->lock);
+		cache_drainFastHits(stripe);
+		cache_addStats(stats, &stripe->stats);
+		mutexUnlock(stripe->lock);
 	}
 
-	mutexUnlock(cache->lock);
+	stats->devReads += atomic_load_explicit(&cache->counters.devReads, memory_order_relaxed);
+	stats->devWrites += atomic_load_explicit(&cache->counters.devWrites, memory_order_relaxed);
+	stats->bytesRead += atomic_load_explicit(&cache->counters.bytesRead, memory_order_relaxed);
+	stats->bytesWritten += atomic_load_explicit(&cache->counters.bytesWritten, memory_order_relaxed);
+	stats->bypassed += atomic_load_explicit(&cache->counters.bypassed, memory_order_relaxed);
+	stats->flushes += atomic_load_explicit(&cache->counters.flushes, memory_order_relaxed);
 
-	return EOK;
+	stats->dirtyLines = atomic_load_explicit(&cache->dirtyCnt, memory_order_relaxed);
+
+	if (cache->pool != NULL) {
+		mutexLock(cache->pool->lock);
+		stats->poolLines = cache->poolUsed;
+		mutexUnlock(cache->pool->lock);
+	}
 }
 
 
-int cache_clean(cachectx_t *cache, const uint64_t begAddr, const uint64_t endAddr)
+void cache_resetStats(cachectx_t *cache)
 {
-	int ret = EOK;
-	uint64_t addr = 0, end = endAddr, tag = 0, index = 0, begOffset = 0;
-	cacheline_t *linePtr = NULL;
+	size_t i;
+	cachestripe_t *stripe;
 
-	if (begAddr > endAddr || begAddr > cache->srcMemSize) {
-		return -EINVAL;
-	}
-	if (begAddr < cache->srcMemSize && endAddr > cache->srcMemSize) {
-		end = cache->srcMemSize;
+	for (i = 0; i <= cache->stripeMask; ++i) {
+		stripe = &cache->stripes[i];
+
+		mutexLock(stripe->lock);
+		atomic_store_explicit(&stripe->fastHits, 0, memory_order_relaxed);
+		memset(&stripe->stats, 0, sizeof(cache_stats_t));
+		mutexUnlock(stripe->lock);
 	}
 
-	begOffset = cache_computeOffset(cache, begAddr);
-	addr = begAddr - begOffset;
+	atomic_store_explicit(&cache->counters.devReads, 0, memory_order_relaxed);
+	atomic_store_explicit(&cache->counters.devWrites, 0, memory_order_relaxed);
+	atomic_store_explicit(&cache->counters.bytesRead, 0, memory_order_relaxed);
+	atomic_store_explicit(&cache->counters.bytesWritten, 0, memory_order_relaxed);
+	atomic_store_explicit(&cache->counters.bypassed, 0, memory_order_relaxed);
+	atomic_store_explicit(&cache->counters.flushes, 0, memory_order_relaxed);
+}
 
-	mutexLock(cache->lock);
 
-	while (addr < end) {
-		index = cache_computeSetIndex(cache, addr);
-		tag = cache_computeTag(cache, addr);
+int cache_getOccupancy(cachectx_t *cache, size_t *hist, size_t histLen)
+{
+	size_t i;
+	cachestripe_t *stripe;
 
-		linePtr = cache_findLine(&cache->sets[index], tag, LIBCACHE_TIMESTAMPS_NO_UPDATE);
+	cache_enter(cache);
 
-		if (linePtr != NULL) {
-			if (IS_DIRTY(linePtr->flags)) {
-				ret = cache_flushLine(cache, linePtr, addr);
-				if (ret < 0) {
-					break;
-				}
-			}
+	if (histLen <= cache->numWays) {
+		cache_leave(cache);
+		return -EINVAL;
+	}
 
-			cache_invalidateLine(&cache->sets[index], linePtr);
-		}
+	memset(hist, 0, histLen * sizeof(size_t));
 
-		addr += cache->lineSize;
+	for (i = 0; i < cache->numSets; ++i) {
+		stripe = cache_lockSet(cache, i);
+		hist[cache->sets[i].count]++;
+		mutexUnlock(stripe->lock);
 	}
 
-	mutexUnlock(cache->lock);
+	cache_leave(cache);
 
-	return ret;
+	return EOK;
 }
@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
 
 
 /* Cache write policies */
@@ -26,6 +27,9 @@
 typedef struct cachectx_s cachectx_t;
 
 
+typedef struct cachepool_s cachepool_t; /* Line buffers shared by several caches */
+
+
 typedef struct cache_devCtx_s cache_devCtx_t; /* Device driver context should be defined by flash driver */
 
 
@@ -35,16 +39,184 @@ typedef ssize_t (*cache_readCb_t)(uint64_t offset, void *buffer, size_t count, c
 typedef ssize_t (*cache_writeCb_t)(uint64_t offset, const void *buffer, size_t count, cache_devCtx_t *ctx);
 
 
-/* Cached source memory interface */
+typedef struct {
+	void *buf;
+	size_t len;
+} cache_iov_t;
+
+
+/* Segment of vectored cache access */
+typedef struct {
+	uint64_t addr;
+	void *buf;
+	size_t len;
+} cache_seg_t;
+
+
+/* Vectored callbacks transfer a contiguous device region from/to consecutive buffers of iov */
+typedef ssize_t (*cache_readvCb_t)(uint64_t offset, const cache_iov_t *iov, size_t iovcnt, cache_devCtx_t *ctx);
+
+
+typedef ssize_t (*cache_writevCb_t)(uint64_t offset, const cache_iov_t *iov, size_t iovcnt, cache_devCtx_t *ctx);
+
+
+/* Completion of asynchronous transfer, ret is number of transferred bytes or negative error */
+typedef void (*cache_doneCb_t)(void *arg, ssize_t ret);
+
+
+/*
+ * Asynchronous callbacks start transfer of contiguous device region from/to consecutive buffers of iov
+ * and return 0, done(arg, ret) is called once it completes (possibly before callback returns). iov stays
+ * valid until completion. Negative return means transfer was not started, done is not called then.
+ */
+typedef int (*cache_readAsyncCb_t)(uint64_t offset, const cache_iov_t *iov, size_t iovcnt, cache_doneCb_t done, void *arg, cache_devCtx_t *ctx);
+
+
+typedef int (*cache_writeAsyncCb_t)(uint64_t offset, const cache_iov_t *iov, size_t iovcnt, cache_doneCb_t done, void *arg, cache_devCtx_t *ctx);
+
+
+/* Cache associativity */
+#define LIBCACHE_WAYS_DEFAULT 4
+#define LIBCACHE_WAYS_FULL    ((size_t)-1) /* Fully associative cache, single set of linesCnt lines */
+
+
+/* Default number of set locks */
+#define LIBCACHE_LOCKS_DEFAULT 8
+
+
+/* Maximum number of lines transferred in one device access */
+#define LIBCACHE_IO_MAX 16
+
+
+/* Maximum number of asynchronous device accesses in flight */
+#define LIBCACHE_IO_DEPTH 16
+
+
+/* Default priority of cache helper threads */
+#define LIBCACHE_THREAD_PRIO 4
+
+
+/* Default stack size of cache helper threads, they call device callbacks */
+#define LIBCACHE_THREAD_STACK (16 * 1024)
+
+
+/* Cache option flags */
+#define LIBCACHE_OPT_PREALLOC  (1 << 0) /* Allocate all line buffers at init in one arena */
+
+/*
+ * Read hits copy data without set lock, buffers of invalidated lines are kept until deinit. Hit is retried if
+ * line changed under set lock during the copy, data modified through cache_pin() pointer is not tracked that
+ * way, so fast hit may return it partially updated while line is pinned.
+ */
+#define LIBCACHE_OPT_FAST_HITS (1 << 1)
+
+
+/* Replacement policies */
+#define LIBCACHE_REPL_LRU   0 /* Least recently used line */
+#define LIBCACHE_REPL_CLOCK 1 /* Second chance, cheapest hit path */
+#define LIBCACHE_REPL_2Q    2 /* Scan resistant, lines referenced once are evicted first */
+
+
+/* Access pattern advice, cache_advise() */
+#define LIBCACHE_ADVICE_NORMAL     0 /* Drops advice given for range */
+#define LIBCACHE_ADVICE_SEQUENTIAL 1 /* Read-ahead starts with the first read, with twice the window, no effect without raWindow */
+#define LIBCACHE_ADVICE_RANDOM     2 /* No read-ahead */
+#define LIBCACHE_ADVICE_WILLNEED   3 /* Prefetch range now */
+#define LIBCACHE_ADVICE_DONTNEED   4 /* Drop clean lines of range, dirty ones are evicted first */
+#define LIBCACHE_ADVICE_NOREUSE    5 /* Lines of range are inserted as least recently used */
+
+
+/* Cached source memory interface, callbacks may be called concurrently for different lines */
 typedef struct {
 	cache_readCb_t readCb;
 	cache_writeCb_t writeCb;
 	cache_devCtx_t *ctx; /* Device driver context */
+
+	/* Optional, NULL if not supported */
+	cache_readvCb_t readvCb;
+	cache_writevCb_t writevCb;
+
+	/* Optional, both or none, synchronous callbacks are still used when request cannot be queued */
+	cache_readAsyncCb_t readAsyncCb;
+	cache_writeAsyncCb_t writeAsyncCb;
 } cache_ops_t;
 
 
+/* Cache options, zeroed fields select defaults */
+typedef struct {
+	size_t numWays;     /* Number of lines in set, linesCnt / numWays must be a power of 2 */
+	unsigned int flags; /* LIBCACHE_OPT_* */
+	size_t lineAlign;   /* Line buffer alignment in preallocated arena, power of 2 */
+	size_t numLocks;    /* Number of locks striped over sets, rounded down to power of 2, kept by cache_resize() */
+	size_t ioLines;     /* Max number of consecutive lines per device access (up to LIBCACHE_IO_MAX), 0 or 1 disables coalescing */
+	size_t ioDepth;     /* Max number of async device accesses in flight (up to LIBCACHE_IO_DEPTH), 0 - LIBCACHE_IO_DEPTH */
+	size_t progUnit;    /* Device program unit (power of 2, at least lineSize), merged write-backs never cross its boundary, 0 - no limit */
+	size_t bypassSize;  /* Transfers of at least this size go directly to/from caller buffer, 0 disables bypass */
+	size_t sectorSize;  /* Valid/dirty tracking unit (power of 2), sectors are fetched and written back individually, 0 - whole line */
+
+	unsigned int replPolicy; /* LIBCACHE_REPL_* */
+
+	size_t raWindow;         /* Number of lines prefetched ahead of sequential reads, 0 disables read-ahead */
+	unsigned int threadPrio; /* Priority of helper threads, 0 selects LIBCACHE_THREAD_PRIO */
+	size_t threadStack;      /* Stack size of helper threads, has to fit device callbacks, 0 selects LIBCACHE_THREAD_STACK */
+
+	/* Background write-back, enabled by setting dirtyHigh and/or dirtyAge */
+	size_t dirtyHigh; /* Number of dirty lines which starts write-back */
+	size_t dirtyLow;  /* Number of dirty lines at which write-back stops, default dirtyHigh / 2 */
+	time_t dirtyAge;  /* Max time (us) line may stay dirty */
+
+	/* Line buffers taken from shared pool, linesCnt of cache then limits only lines resident at once */
+	cachepool_t *pool;
+	size_t poolMin; /* Number of lines never reclaimed by other caches of pool */
+	size_t poolMax; /* Max number of lines held, 0 - linesCnt */
+} cache_opts_t;
+
+
+typedef struct {
+	uint64_t hits;
+	uint64_t fastHits; /* Hits served without set lock, counted in hits too */
+	uint64_t misses;
+	uint64_t evictions;      /* Valid lines replaced by other lines */
+	uint64_t dirtyEvictions; /* Evictions which had to write back victim first */
+	uint64_t raLines;        /* Lines fetched by read-ahead */
+	uint64_t raHits;         /* Lines fetched by read-ahead and then accessed */
+	uint64_t warmLines;      /* Lines preloaded by cache_importHot() */
+	uint64_t poolReclaims;   /* Lines of other caches of pool replaced by lines of this one */
+
+	uint64_t devReads;  /* Number of successful read callback calls */
+	uint64_t devWrites; /* Number of successful write callback calls */
+	uint64_t bytesRead;
+	uint64_t bytesWritten;
+	uint64_t bypassed; /* Bytes transferred directly between device and caller buffers */
+
+	uint64_t flushes;      /* Number of cache_flush() and cache_clean() calls */
+	uint64_t linesFlushed; /* Number of dirty lines written back for any reason */
+
+	uint64_t lockAcquires;  /* Set lock acquisitions */
+	uint64_t lockContended; /* Set lock acquisitions which had to wait */
+	uint64_t lockWaitTime;  /* Total time (us) spent waiting for set locks */
+
+	size_t dirtyLines; /* Current number of dirty lines */
+	size_t poolLines;  /* Current number of line buffers taken from pool */
+} cache_stats_t;
+
+
+/*
+ * Creates pool of linesCnt line buffers for caches of lineSize lines. Once pool is used up, cache below
+ * its poolMax replaces least recently used clean line of any cache of pool holding more than its poolMin.
+ */
+cachepool_t *cache_poolCreate(size_t lineSize, size_t linesCnt, size_t lineAlign);
+
+
+/* Returns -EBUSY if pool is still used by any cache */
+int cache_poolDestroy(cachepool_t *pool);
+
+
 cachectx_t *cache_init(size_t srcMemSize, size_t lineSize, size_t linesCnt, const cache_ops_t *ops);
 
+cachectx_t *cache_initEx(size_t srcMemSize, size_t lineSize, size_t linesCnt, const cache_ops_t *ops, const cache_opts_t *opts);
+
+/* Writes back dirty lines and releases cache, even if some write-back fails. Returns error of the first one. */
 int cache_deinit(cachectx_t *cache);
 
 
@@ -54,6 +226,29 @@ ssize_t cache_read(cachectx_t *cache, uint64_t addr, void *buffer, size_t count)
 ssize_t cache_write(cachectx_t *cache, uint64_t addr, const void *buffer, size_t count, int policy);
 
 
+/*
+ * Reads segments in address order, misses of adjacent lines of all segments are fetched with single device
+ * accesses. Segments are clamped to source memory as in cache_read(). Returns total number of bytes read.
+ */
+ssize_t cache_readv(cachectx_t *cache, const cache_seg_t *segs, size_t segcnt);
+
+
+/* Writes segments in given order, written through lines of adjacent segments are written back together */
+ssize_t cache_writev(cachectx_t *cache, const cache_seg_t *segs, size_t segcnt, int policy);
+
+
+/*
+ * Gives direct access to cached data of [addr, addr + count) range, which has to lie within single line.
+ * Line is not evicted until every cache_pin() is matched by cache_unpin(). Caller must not keep all lines
+ * of a set pinned while accessing other lines mapped to it.
+ */
+int cache_pin(cachectx_t *cache, uint64_t addr, size_t count, void **data);
+
+
+/* Releases line pinned at addr, dirty != 0 marks line as modified (written back as with LIBCACHE_WRITE_BACK) */
+int cache_unpin(cachectx_t *cache, uint64_t addr, int dirty);
+
+
 int cache_flush(cachectx_t *cache, const uint64_t begAddr, const uint64_t endAddr);
 
 
@@ -63,4 +258,47 @@ int cache_invalidate(cachectx_t *cache, const uint64_t begAddr, const uint64_t e
 int cache_clean(cachectx_t *cache, const uint64_t begAddr, const uint64_t endAddr);
 
 
+/*
+ * Changes number of lines keeping number of ways (single set of fully associative cache changes its size).
+ * Resident lines are rehashed into new sets, only lines not fitting them are written back and dropped, least
+ * recently used first. Other calls are served meanwhile, they are held back only while lines are moved.
+ * Number of set locks is fixed at cache_initEx() (numLocks capped by number of sets then), grown cache shares
+ * them among more sets.
+ * Returns -EBUSY if pinned line would not fit (or would move to other buffer of preallocated arena),
+ * -EAGAIN if lines not fitting keep getting dirty while written back, -EINVAL if linesCnt / numWays is not
+ * a power of 2.
+ */
+int cache_resize(cachectx_t *cache, size_t linesCnt);
+
+
+/*
+ * Advises expected access pattern of range (LIBCACHE_ADVICE_*). SEQUENTIAL, RANDOM and NOREUSE persist
+ * until replaced by other advice for the range, -ENOSPC is returned if too many ranges are advised.
+ * SEQUENTIAL and RANDOM only steer read-ahead, so they do nothing unless cache_opts_t.raWindow is set.
+ */
+int cache_advise(cachectx_t *cache, const uint64_t begAddr, const uint64_t endAddr, int hint);
+
+
+/*
+ * Exports addresses of valid lines into blob, for cache_importHot() after restart. Lines are ordered by
+ * recency rank within their sets, most recently used first, so a blob too small keeps the hottest ones.
+ * Returns number of bytes stored, or size sufficient for any content of cache if blob is NULL.
+ */
+ssize_t cache_exportHot(cachectx_t *cache, void *blob, size_t size);
+
+
+/* Prefetches lines listed by cache_exportHot() in address sorted batches, line size of exporting cache may differ */
+int cache_importHot(cachectx_t *cache, const void *blob, size_t size);
+
+
+void cache_getStats(cachectx_t *cache, cache_stats_t *stats);
+
+
+void cache_resetStats(cachectx_t *cache);
+
+
+/* Fills hist[n] with number of sets holding n valid lines, histLen must exceed number of ways */
+int cache_getOccupancy(cachectx_t *cache, size_t *hist, size_t histLen);
+
+
 #endif